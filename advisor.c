@@ -0,0 +1,758 @@
+/* -------------------------------------------------------------------------
+ *
+ * advisor.c
+ *
+ *   根据 catalog 和统计信息估算 DDL 的代价，给出建议或拒绝执行．
+ *
+ * Copyright (c) 2017-2017, Qunar DBA Group
+ *
+ * IDENTIFICATION
+ *      contrib/pgsword/advisor.c
+ *
+ * -------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include <math.h>
+
+#include "access/heapam.h"
+#include "access/htup_details.h"
+#include "access/itup.h"
+#include "access/tupmacs.h"
+#include "access/tuptoaster.h"
+#include "commands/defrem.h"
+#include "commands/tablespace.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_trigger.h"
+#include "lib/stringinfo.h"
+#include "miscadmin.h"
+#include "nodes/parsenodes.h"
+#include "storage/bufmgr.h"
+#include "storage/bufpage.h"
+#include "storage/itemid.h"
+#include "rewrite/rewriteHandler.h"
+#include "tcop/tcopprot.h"
+#include "utils/builtins.h"
+#include "parser/parse_type.h"
+#include "pgstat.h"
+#include "utils/lsyscache.h"
+#include "utils/rel.h"
+#include "utils/timestamp.h"
+
+#include "pgsword.h"
+#include "advisor.h"
+#include "indexadvisor.h"
+#include "tools.h"
+
+/* 没有统计信息的表达式索引列，按这个宽度估算 */
+#define DEFAULT_EXPR_WIDTH       32
+
+/*
+ * tuplesort 里每个元组除了 IndexTuple 本身，还有 SortTuple (24 字节)
+ * 和 palloc chunk header (16 字节) 的开销．
+ */
+#define SORT_TUPLE_OVERHEAD      (24 + 16)
+
+/* 估算建索引时间用的参数：顺序读写吞吐，每次比较的 CPU 时间 */
+#define BUILD_IO_BYTES_PER_SEC   (200.0 * 1024 * 1024)
+#define BUILD_NSEC_PER_COMPARE   25.0
+
+/* B-tree 默认 fillfactor */
+#define BTREE_FILLFACTOR         0.90
+
+/* 给频繁更新的表推荐 fillfactor 的范围 */
+#define MIN_RECOMMENDED_FILLFACTOR   50
+#define MAX_RECOMMENDED_FILLFACTOR   90
+
+char *prettySize(int64 bytes) {
+    return text_to_cstring(DatumGetTextPP(
+                DirectFunctionCall1(pg_size_pretty, Int64GetDatum(bytes))));
+}
+
+/* 索引键的平均宽度：有统计信息用 pg_statistic，没有就按类型估算 */
+static int32 indexKeyWidth(Oid relid, List *indexParams) {
+    ListCell *l;
+    int32     width = 0;
+
+    foreach(l, indexParams) {
+        IndexElem  *elem = (IndexElem *) lfirst(l);
+        AttrNumber  attnum;
+        Oid         atttypid;
+        int32       atttypmod;
+        Oid         attcollid;
+        int32       w;
+
+        if ( elem->name == NULL ) {
+            width += DEFAULT_EXPR_WIDTH;
+            continue;
+        }
+
+        attnum = get_attnum(relid, elem->name);
+        if ( attnum == InvalidAttrNumber ) {
+            width += DEFAULT_EXPR_WIDTH;
+            continue;
+        }
+
+        w = get_attavgwidth(relid, attnum);
+        if ( w <= 0 ) {
+            get_atttypetypmodcoll(relid, attnum, &atttypid, &atttypmod, &attcollid);
+            w = get_typavgwidth(atttypid, atttypmod);
+        }
+        width += w;
+    }
+
+    return width;
+}
+
+/*
+ * checkIndexBuild - 估算 CREATE INDEX 的代价
+ *
+ *   根据表的大小，索引列的宽度和 maintenance_work_mem 估算索引大小，
+ * 排序是否会落盘，临时文件大小和建索引的时间．
+ *   不带 CONCURRENTLY 的 CREATE INDEX 会在整个建索引期间阻塞写入，
+ * 表超过 pgsword.index_concurrently_threshold 时直接拒绝．
+ *   表还不存在 (比如同一个脚本里刚建的表) 时没有什么可估算的．
+ */
+void checkIndexBuild(IndexStmt *stmt) {
+    Oid         relid;
+    Relation    rel;
+    BlockNumber nblocks;
+    double      ntuples;
+    int64       heapBytes;
+    int32       keyWidth;
+    int64       itupSize;
+    int64       sortBytes;
+    int64       indexBytes;
+    int64       tempBytes = 0;
+    int64       sortMem = (int64) maintenance_work_mem * 1024L;
+    bool        spill;
+    bool        isBtree;
+    double      seconds;
+    int64       threshold = (int64) pgsword_index_concurrently_threshold * 1024 * 1024;
+
+    if ( stmt->relation == NULL ) {
+        return;
+    }
+
+    relid = RangeVarGetRelid(stmt->relation, AccessShareLock, true);
+    if ( !OidIsValid(relid) ) {
+        return;
+    }
+
+    rel = heap_open(relid, NoLock);
+    nblocks = RelationGetNumberOfBlocks(rel);
+    ntuples = rel->rd_rel->reltuples;
+    heap_close(rel, NoLock);
+
+    heapBytes = (int64) nblocks * BLCKSZ;
+    keyWidth = indexKeyWidth(relid, stmt->indexParams);
+    itupSize = MAXALIGN(sizeof(IndexTupleData) + keyWidth);
+
+    // 没 ANALYZE 过的表 reltuples 为 0，按满页估一个上限
+    if ( ntuples <= 0 && nblocks > 0 ) {
+        ntuples = (double) nblocks * (BLCKSZ / (double) (itupSize + sizeof(ItemIdData)));
+    }
+
+    isBtree = stmt->accessMethod == NULL || strcmp(stmt->accessMethod, "btree") == 0;
+
+    sortBytes = (int64) (ntuples * (itupSize + SORT_TUPLE_OVERHEAD));
+    indexBytes = (int64) (ntuples * (itupSize + sizeof(ItemIdData)) / (BLCKSZ * BTREE_FILLFACTOR)) * BLCKSZ;
+
+    // 只有 B-tree 建索引时会整体排序
+    spill = isBtree && sortBytes > sortMem;
+    if ( spill ) {
+        tempBytes = (int64) (ntuples * itupSize);
+    }
+
+    // 扫一遍表，写一遍索引，落盘时临时文件一写一读，再加上排序的比较
+    seconds = (heapBytes + indexBytes + 2.0 * tempBytes) / BUILD_IO_BYTES_PER_SEC;
+    if ( ntuples > 1 ) {
+        seconds += ntuples * log2(ntuples) * BUILD_NSEC_PER_COMPARE / 1e9;
+    }
+
+    ereport(NOTICE,
+            (errcode(ERRCODE_SUCCESSFUL_COMPLETION),
+                errmsg("QunarSQLAudit: index on \"%s\": table %s, %.0f rows, "
+                       "estimated index size %s, sort %s (maintenance_work_mem %s)%s%s, "
+                       "estimated build time %.0f s",
+                       stmt->relation->relname,
+                       prettySize(heapBytes),
+                       ntuples,
+                       prettySize(indexBytes),
+                       prettySize(sortBytes),
+                       prettySize(sortMem),
+                       spill ? ", spills to disk, temp files " : ", fits in memory",
+                       spill ? prettySize(tempBytes) : "",
+                       seconds)));
+
+    if ( threshold >= 0 && heapBytes >= threshold && !stmt->concurrent ) {
+        ereport(ERROR,
+                (errcode(ERRCODE_INTERNAL_ERROR),
+                    errmsg("QunarSQLAudit: table \"%s\" is %s, CREATE INDEX on it must use CONCURRENTLY",
+                           stmt->relation->relname,
+                           prettySize(heapBytes)),
+                    errdetail("a plain CREATE INDEX blocks all writes to the table for about %.0f s",
+                              seconds)));
+    }
+}
+
+/* 一个列在行内的布局信息 */
+typedef struct ColLayout {
+    const char *colname;
+    int16       typlen;     /* -1 varlena, -2 cstring */
+    char        typalign;
+    int32       width;      /* 变长列用平均宽度 */
+    int         attnum;     /* 声明顺序，排序时保持稳定 */
+} ColLayout;
+
+static int alignBytes(char typalign) {
+    switch ( typalign ) {
+        case 'd': return ALIGNOF_DOUBLE;
+        case 'i': return ALIGNOF_INT;
+        case 's': return ALIGNOF_SHORT;
+        default:  return 1;
+    }
+}
+
+/*
+ * 按列顺序计算数据部分的长度和其中的对齐填充．
+ *
+ *   变长列的值大多小于 127 字节，用 1 字节的短头存放，不需要对齐，
+ * 所以这里只对定长列做对齐．
+ *   行的数据部分最后还要补齐到 MAXALIGN，这部分也计入填充．
+ */
+static int32 rowDataLength(ColLayout *cols, int ncols, int32 *padding) {
+    int32 off = 0;
+    int32 pad = 0;
+    int   i;
+
+    for ( i = 0; i < ncols; i++ ) {
+        if ( cols[i].typlen > 0 ) {
+            int32 aligned = att_align_nominal(off, cols[i].typalign);
+
+            pad += aligned - off;
+            off = aligned + cols[i].typlen;
+        }
+        else {
+            off += cols[i].width;
+        }
+    }
+
+    pad += MAXALIGN(off) - off;
+    *padding = pad;
+
+    return MAXALIGN(off);
+}
+
+/* 定长列在前，按对齐要求从大到小；变长列放最后；其余保持声明顺序 */
+static int colLayoutCmp(const void *a, const void *b) {
+    const ColLayout *ca = (const ColLayout *) a;
+    const ColLayout *cb = (const ColLayout *) b;
+    bool  fixa = ca->typlen > 0;
+    bool  fixb = cb->typlen > 0;
+
+    if ( fixa != fixb ) {
+        return fixa ? -1 : 1;
+    }
+
+    if ( fixa && alignBytes(ca->typalign) != alignBytes(cb->typalign) ) {
+        return alignBytes(cb->typalign) - alignBytes(ca->typalign);
+    }
+
+    return ca->attnum - cb->attnum;
+}
+
+/*
+ * checkColumnAlignment - 列顺序的对齐填充
+ *
+ *   按 pg_type 的 typlen 和 typalign 算出声明顺序下每行浪费的填充字节，
+ * 并给出填充最少的列顺序，以及每行，每百万行能省下的空间．
+ *   能省下的字节超过 pgsword.alignment_waste_threshold 时给出 WARNING．
+ */
+void checkColumnAlignment(CreateStmt *stmt) {
+    ListCell       *l;
+    ColLayout      *cols;
+    int             ncols = 0;
+    int32           declLen;
+    int32           declPad;
+    int32           bestLen;
+    int32           bestPad;
+    int32           saved;
+    int             i;
+    StringInfoData  order;
+
+    if ( stmt == NULL || list_length(stmt->tableElts) < 2 ) {
+        return;
+    }
+
+    cols = palloc0(sizeof(ColLayout) * list_length(stmt->tableElts));
+
+    foreach(l, stmt->tableElts) {
+        ColumnDef *colDef = (ColumnDef *) lfirst(l);
+        Oid        atttypid;
+        int32      atttypmod;
+        bool       typbyval;
+
+        if ( !IsA(colDef, ColumnDef) ) {
+            continue;
+        }
+
+        typenameTypeIdAndMod(NULL, colDef->typeName, &atttypid, &atttypmod);
+        get_typlenbyvalalign(atttypid,
+                             &cols[ncols].typlen,
+                             &typbyval,
+                             &cols[ncols].typalign);
+
+        cols[ncols].colname = colDef->colname;
+        cols[ncols].width = cols[ncols].typlen > 0
+                                ? cols[ncols].typlen
+                                : get_typavgwidth(atttypid, atttypmod);
+        cols[ncols].attnum = ncols;
+        ncols++;
+    }
+
+    declLen = rowDataLength(cols, ncols, &declPad);
+
+    qsort(cols, ncols, sizeof(ColLayout), colLayoutCmp);
+    bestLen = rowDataLength(cols, ncols, &bestPad);
+
+    saved = declLen - bestLen;
+    if ( saved <= 0 ) {
+        ereport(NOTICE,
+                (errcode(ERRCODE_SUCCESSFUL_COMPLETION),
+                    errmsg("QunarSQLAudit: column order of \"%s\" is already well aligned, "
+                           "%d bytes of padding per row",
+                           stmt->relation->relname, declPad)));
+        pfree(cols);
+        return;
+    }
+
+    initStringInfo(&order);
+    for ( i = 0; i < ncols; i++ ) {
+        appendStringInfo(&order, "%s%s", i > 0 ? ", " : "", cols[i].colname);
+    }
+
+    ereport((pgsword_alignment_waste_threshold >= 0 &&
+             saved > pgsword_alignment_waste_threshold) ? WARNING : NOTICE,
+            (errcode(ERRCODE_SUCCESSFUL_COMPLETION),
+                errmsg("QunarSQLAudit: column order of \"%s\" wastes %d bytes of padding per row, "
+                       "suggested order (%s) saves %d bytes per row, %s per million rows",
+                       stmt->relation->relname,
+                       declPad,
+                       order.data,
+                       saved,
+                       prettySize((int64) saved * 1000000))));
+
+    pfree(order.data);
+    pfree(cols);
+}
+
+/* WITH (fillfactor = N) 里的值，没写返回 HEAP_DEFAULT_FILLFACTOR */
+static int declaredFillfactor(List *options) {
+    ListCell *l;
+
+    foreach(l, options) {
+        DefElem *def = (DefElem *) lfirst(l);
+
+        if ( def->defnamespace == NULL && strcmp(def->defname, "fillfactor") == 0 ) {
+            return (int) defGetInt64(def);
+        }
+    }
+
+    return HEAP_DEFAULT_FILLFACTOR;
+}
+
+/*
+ * checkRowWidth - 估算行宽，TOAST 和 fillfactor
+ *
+ *   平均行宽用 get_typavgwidth() 按类型和 typmod 估算，最大行宽用
+ * type_maximum_size()，没有长度上限的变长类型 (text, bytea, jsonb...)
+ * 没有最大行宽．
+ *   平均行宽超过 TOAST_TUPLE_THRESHOLD 的表，大部分行都会被 TOAST，
+ * 读一行要多查一次 TOAST 表．
+ *   pgsword.update_heavy_tables 里声明的表，要留出足够的页内空间让
+ * UPDATE 走 HOT，否则每次更新都要改所有索引．
+ */
+void checkRowWidth(CreateStmt *stmt) {
+    ListCell   *l;
+    int         natts = 0;
+    int32       avgData = 0;
+    int32       maxData = 0;
+    bool        unbounded = false;
+    int32       hoff;
+    int32       avgRow;
+    int32       maxRow;
+    int         rowsPerPage;
+
+    if ( stmt == NULL || stmt->relation == NULL ) {
+        return;
+    }
+
+    foreach(l, stmt->tableElts) {
+        ColumnDef *colDef = (ColumnDef *) lfirst(l);
+        Oid        atttypid;
+        int32      atttypmod;
+        int16      typlen;
+        bool       typbyval;
+        char       typalign;
+        int32      maxw;
+
+        if ( !IsA(colDef, ColumnDef) ) {
+            continue;
+        }
+
+        typenameTypeIdAndMod(NULL, colDef->typeName, &atttypid, &atttypmod);
+        get_typlenbyvalalign(atttypid, &typlen, &typbyval, &typalign);
+
+        if ( typlen > 0 ) {
+            avgData = att_align_nominal(avgData, typalign) + typlen;
+            maxData = att_align_nominal(maxData, typalign) + typlen;
+        }
+        else {
+            avgData += get_typavgwidth(atttypid, atttypmod);
+
+            maxw = type_maximum_size(atttypid, atttypmod);
+            if ( maxw < 0 ) {
+                unbounded = true;
+            }
+            else {
+                // 超过 126 字节的值用 4 字节的长头，要按 int 对齐；
+                // type_maximum_size() 已经算上了 VARHDRSZ
+                maxData = att_align_nominal(maxData, typalign) + maxw;
+            }
+        }
+        natts++;
+    }
+
+    if ( natts == 0 ) {
+        return;
+    }
+
+    hoff = MAXALIGN(SizeofHeapTupleHeader + BITMAPLEN(natts));
+    avgRow = hoff + MAXALIGN(avgData);
+    maxRow = hoff + MAXALIGN(maxData);
+    rowsPerPage = (BLCKSZ - SizeOfPageHeaderData) / (avgRow + sizeof(ItemIdData));
+
+    if ( unbounded ) {
+        ereport(NOTICE,
+                (errcode(ERRCODE_SUCCESSFUL_COMPLETION),
+                    errmsg("QunarSQLAudit: table \"%s\": estimated row width %d bytes on average, "
+                           "unbounded maximum, about %d rows per page",
+                           stmt->relation->relname, avgRow, rowsPerPage)));
+    }
+    else {
+        ereport(NOTICE,
+                (errcode(ERRCODE_SUCCESSFUL_COMPLETION),
+                    errmsg("QunarSQLAudit: table \"%s\": estimated row width %d bytes on average, "
+                           "%d bytes at most, about %d rows per page",
+                           stmt->relation->relname, avgRow, maxRow, rowsPerPage)));
+    }
+
+    if ( avgRow > TOAST_TUPLE_THRESHOLD ) {
+        ereport(WARNING,
+                (errmsg("QunarSQLAudit: rows of \"%s\" average %d bytes, above the TOAST threshold "
+                        "of %d bytes, most rows will be TOASTed",
+                        stmt->relation->relname, avgRow, (int) TOAST_TUPLE_THRESHOLD),
+                    errhint("move large, rarely read columns to a separate table")));
+    }
+    else if ( unbounded || maxRow > TOAST_TUPLE_THRESHOLD ) {
+        ereport(NOTICE,
+                (errcode(ERRCODE_SUCCESSFUL_COMPLETION),
+                    errmsg("QunarSQLAudit: rows of \"%s\" larger than %d bytes will be TOASTed",
+                           stmt->relation->relname, (int) TOAST_TUPLE_THRESHOLD)));
+    }
+
+    if ( tableInList(pgsword_update_heavy_tables,
+                     stmt->relation->schemaname,
+                     stmt->relation->relname) ) {
+        int   declared = declaredFillfactor(stmt->options);
+        int   reserve;
+        int   recommended;
+
+        // 至少留出两个新版本行，或者一成的页面
+        reserve = Max(2 * (avgRow + (int) sizeof(ItemIdData)), BLCKSZ / 10);
+        recommended = 100 - (reserve * 100 + BLCKSZ - 1) / BLCKSZ;
+        recommended = Max(recommended, MIN_RECOMMENDED_FILLFACTOR);
+        recommended = Min(recommended, MAX_RECOMMENDED_FILLFACTOR);
+
+        if ( declared > recommended ) {
+            ereport(WARNING,
+                    (errmsg("QunarSQLAudit: \"%s\" is update-heavy but has fillfactor %d, "
+                            "use WITH (fillfactor = %d) so that updates stay HOT",
+                            stmt->relation->relname, declared, recommended),
+                        errhint("HOT updates also require that the updated columns are not indexed")));
+        }
+    }
+}
+
+/*
+ * 执行前检查 CTAS 时规划出来的计划，留给紧接着的 ExecCreateTableAs 用，
+ * 同一个查询不用规划两遍．ctasQuery 是规划前的查询，planner 会改写
+ * 传给它的查询树．
+ */
+static Query         *ctasQuery = NULL;
+static ParamListInfo  ctasParams = NULL;
+static PlannedStmt   *ctasPlan = NULL;
+
+/*
+ * takeCtasPlan - planner_hook 调用，查询和 checkCreateTableAs() 规划的
+ * 完全相同时返回那个计划 (只用一次)，否则返回 NULL．
+ */
+PlannedStmt *takeCtasPlan(Query *parse, int cursorOptions, ParamListInfo boundParams) {
+    PlannedStmt *plan = NULL;
+
+    if ( ctasPlan != NULL
+        &&
+         cursorOptions == 0
+        &&
+         boundParams == ctasParams
+        &&
+         equal(parse, ctasQuery) ) {
+        plan = ctasPlan;
+        forgetCtasPlan();
+    }
+
+    return plan;
+}
+
+/* CTAS 语句执行完 (或者出错) 后丢掉没用上的计划 */
+void forgetCtasPlan(void) {
+    ctasQuery = NULL;
+    ctasParams = NULL;
+    ctasPlan = NULL;
+}
+
+/* 和 DefineRelation 一样确定新表所在的表空间，InvalidOid 换成库的默认表空间 */
+static Oid ctasTargetTablespace(IntoClause *into) {
+    Oid spcid;
+
+    if ( into->tableSpaceName != NULL ) {
+        spcid = get_tablespace_oid(into->tableSpaceName, true);
+    }
+    else {
+        spcid = GetDefaultTablespace(into->rel->relpersistence);
+    }
+
+    return OidIsValid(spcid) ? spcid : MyDatabaseTableSpace;
+}
+
+/*
+ * checkCreateTableAs - CREATE TABLE AS / SELECT INTO / CREATE MATERIALIZED VIEW
+ *
+ *   先把内嵌的查询规划一遍，用计划的行数和行宽估算结果的大小．
+ * 超过 pgsword.ctas_max_size 时，只允许 UNLOGGED 表 (不写 WAL) 或者
+ * 建在 pgsword.ctas_tablespace 指定的专用表空间上 (没写 TABLESPACE 时
+ * 按 default_tablespace 算)，否则拒绝．物化视图不能是 UNLOGGED．
+ *   分析师跑失控的 CTAS 写满过主库的数据盘和 WAL．
+ *   verbose 为 true 时 (审核模式) 总是输出估算结果；否则语句马上就要
+ * 执行，计划留给 ExecCreateTableAs，调用方执行完要 forgetCtasPlan()．
+ */
+void checkCreateTableAs(CreateTableAsStmt *stmt, ParamListInfo params, bool verbose) {
+    IntoClause  *into = stmt->into;
+    List        *rewritten;
+    PlannedStmt *plan;
+    double       rows;
+    int64        bytes;
+    int64        budget = (int64) pgsword_ctas_max_size * 1024 * 1024;
+    Query       *query;
+    bool         isUnlogged;
+    bool         inTablespace;
+    bool         hasTablespace = pgsword_ctas_tablespace != NULL && pgsword_ctas_tablespace[0] != '\0';
+    const char  *what = stmt->relkind == OBJECT_MATVIEW ? "CREATE MATERIALIZED VIEW"
+                        : (stmt->is_select_into ? "SELECT INTO" : "CREATE TABLE AS");
+
+    if ( (budget < 0 && !verbose) || into == NULL || into->skipData
+        ||
+         stmt->query == NULL || !IsA(stmt->query, Query) ) {
+        return;
+    }
+
+    // 和 ExecCreateTableAs 一样，先 rewrite 再规划
+    rewritten = QueryRewrite((Query *) copyObject(stmt->query));
+    if ( list_length(rewritten) != 1 ) {
+        return;
+    }
+    query = (Query *) linitial(rewritten);
+
+    // CREATE TABLE AS EXECUTE 之类的没有计划
+    if ( query->commandType != CMD_SELECT || query->utilityStmt != NULL ) {
+        return;
+    }
+
+    forgetCtasPlan();
+    if ( !verbose ) {
+        ctasQuery = copyObject(query);
+    }
+    plan = pg_plan_query(query, 0, params);
+    if ( !verbose ) {
+        ctasParams = params;
+        ctasPlan = plan;
+    }
+
+    rows = plan->planTree->plan_rows;
+    bytes = (int64) (rows * (MAXALIGN(SizeofHeapTupleHeader) +
+                             MAXALIGN(plan->planTree->plan_width) +
+                             sizeof(ItemIdData)));
+
+    if ( verbose ) {
+        ereport(NOTICE,
+                (errcode(ERRCODE_SUCCESSFUL_COMPLETION),
+                    errmsg("QunarSQLAudit: %s \"%s\": estimated %.0f rows, %s",
+                           what, into->rel->relname, rows, prettySize(bytes))));
+    }
+
+    if ( budget < 0 || bytes <= budget ) {
+        return;
+    }
+
+    isUnlogged = into->rel->relpersistence == RELPERSISTENCE_UNLOGGED;
+    inTablespace = hasTablespace
+                   &&
+                   ctasTargetTablespace(into) == get_tablespace_oid(pgsword_ctas_tablespace, true);
+
+    if ( isUnlogged || inTablespace ) {
+        return;
+    }
+
+    forgetCtasPlan();
+    ereport(ERROR,
+            (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+                errmsg("QunarSQLAudit: %s \"%s\" is estimated at %s (%.0f rows), "
+                       "over the budget of %s",
+                       what, into->rel->relname, prettySize(bytes), rows, prettySize(budget)),
+                stmt->relkind != OBJECT_TABLE
+                    ? (hasTablespace
+                       ? errhint("create it in tablespace \"%s\", or narrow the query",
+                                 pgsword_ctas_tablespace)
+                       : errhint("narrow the query"))
+                    : (hasTablespace
+                       ? errhint("create it as UNLOGGED, or in tablespace \"%s\"",
+                                 pgsword_ctas_tablespace)
+                       : errhint("create it as UNLOGGED, or narrow the query"))));
+}
+
+/*
+ * checkCreateTrigger - 审核写入频繁的表上的 FOR EACH ROW 触发器
+ *
+ *   行级触发器对每一行修改都在写入事务里调用一次触发器函数，
+ * 写入频繁的表上加一个就可能让写入吞吐掉几倍．
+ *   写入速度取索引建议进程 (pgsword.index_advisor_database) 在
+ * pgsword.index_advisor_window 内采样到的写入行数的变化，只算触发器
+ * 关心的事件．
+ *   超过 pgsword.row_trigger_max_write_rate 时给出警告，打开
+ * pgsword.reject_row_trigger 时拒绝，并建议改用带 transition table
+ * 的语句级触发器．
+ *   没有采样 (表上没有索引，或者没有运行索引建议进程) 时用累积统计
+ * n_tup_ins/upd/del 除以统计信息重置以来的时间．表可能是后来才建的，
+ * 这样算出的速度只会偏低，超过阈值时同样拒绝；连累积统计都没有时
+ * 给出 NOTICE 说明没有审核．
+ */
+void checkCreateTrigger(CreateTrigStmt *stmt) {
+    Oid                  relid;
+    PgStat_StatTabEntry *tabentry;
+    PgStat_StatDBEntry  *dbentry;
+    int64                inserts;
+    int64                updates;
+    int64                deletes;
+    int64                writes = 0;
+    bool                 sampled;
+    long                 secs;
+    int                  usecs;
+    double               elapsed;
+    double               rate;
+    StringInfoData       events;
+    StringInfoData       referencing;
+    int                  nevents = 0;
+
+    if ( !stmt->row || stmt->relation == NULL || pgsword_row_trigger_max_write_rate < 0 ) {
+        return;
+    }
+
+    relid = RangeVarGetRelid(stmt->relation, AccessShareLock, true);
+    if ( !OidIsValid(relid) || get_rel_relkind(relid) != RELKIND_RELATION ) {
+        return;
+    }
+
+    sampled = indexAdvisorTableWrites(relid, &inserts, &updates, &deletes, &elapsed);
+    if ( !sampled ) {
+        tabentry = pgstat_fetch_stat_tabentry(relid);
+        dbentry = pgstat_fetch_stat_dbentry(MyDatabaseId);
+        if ( tabentry == NULL || dbentry == NULL ) {
+            ereport(NOTICE,
+                    (errcode(ERRCODE_SUCCESSFUL_COMPLETION),
+                        errmsg("QunarSQLAudit: no write statistics for table \"%s\", "
+                               "row trigger \"%s\" not checked",
+                               stmt->relation->relname, stmt->trigname)));
+            return;
+        }
+
+        inserts = tabentry->tuples_inserted;
+        updates = tabentry->tuples_updated;
+        deletes = tabentry->tuples_deleted;
+        TimestampDifference(dbentry->stat_reset_timestamp, GetCurrentTimestamp(), &secs, &usecs);
+        elapsed = secs + usecs / 1000000.0;
+    }
+
+    initStringInfo(&events);
+    initStringInfo(&referencing);
+
+    if ( stmt->events & TRIGGER_TYPE_INSERT ) {
+        writes += inserts;
+        appendStringInfoString(&events, "INSERT");
+        appendStringInfoString(&referencing, " NEW TABLE AS new_rows");
+        nevents++;
+    }
+    if ( stmt->events & TRIGGER_TYPE_UPDATE ) {
+        writes += updates;
+        appendStringInfo(&events, "%sUPDATE", nevents > 0 ? " OR " : "");
+        resetStringInfo(&referencing);
+        appendStringInfoString(&referencing, " OLD TABLE AS old_rows NEW TABLE AS new_rows");
+        nevents++;
+    }
+    if ( stmt->events & TRIGGER_TYPE_DELETE ) {
+        writes += deletes;
+        appendStringInfo(&events, "%sDELETE", nevents > 0 ? " OR " : "");
+        resetStringInfo(&referencing);
+        appendStringInfoString(&referencing, " OLD TABLE AS old_rows");
+        nevents++;
+    }
+
+    elapsed = Max(elapsed, 1.0);
+    rate = writes / elapsed;
+
+    ereport(NOTICE,
+            (errcode(ERRCODE_SUCCESSFUL_COMPLETION),
+                errmsg("QunarSQLAudit: row trigger \"%s\" on \"%s\" (%s) would fire about %.1f times per second, "
+                       "average over the last %.0f s%s",
+                       stmt->trigname, stmt->relation->relname, events.data, rate, elapsed,
+                       sampled ? "" : " (since the statistics reset, a lower bound if the table is younger)")));
+
+    if ( rate < pgsword_row_trigger_max_write_rate ) {
+        return;
+    }
+
+    ereport(pgsword_reject_row_trigger ? ERROR : WARNING,
+            (errcode(ERRCODE_INTERNAL_ERROR),
+                errmsg("QunarSQLAudit: table \"%s\" takes %.0f %s per second, "
+                       "FOR EACH ROW trigger \"%s\" would run its function for every one of them",
+                       stmt->relation->relname, rate, events.data, stmt->trigname),
+                errdetail("pgsword.row_trigger_max_write_rate is %d; row triggers run inside the "
+                          "writing transaction and can cut write throughput several times",
+                          pgsword_row_trigger_max_write_rate),
+                stmt->isconstraint
+                    ? errhint("constraint triggers are always row-level, "
+                              "consider checking the rule in a periodic batch job instead")
+                    : stmt->timing != TRIGGER_TYPE_AFTER
+                    ? errhint("if the function does not modify NEW, make it an AFTER ... FOR EACH STATEMENT "
+                              "trigger with a transition table and process all rows in one call")
+                    : nevents > 1 || stmt->columns != NIL
+                    ? errhint("use one AFTER ... FOR EACH STATEMENT trigger per event with a transition table "
+                              "(REFERENCING ... TABLE AS); transition tables do not allow several events "
+                              "or a column list")
+                    : errhint("CREATE TRIGGER %s AFTER %s ON %s REFERENCING%s FOR EACH STATEMENT ...",
+                              stmt->trigname, events.data, stmt->relation->relname, referencing.data)));
+
+    pfree(events.data);
+    pfree(referencing.data);
+}
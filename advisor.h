@@ -0,0 +1,18 @@
+#ifndef _Qunar_SQL_Audit_ADVISOR_H
+#define _Qunar_SQL_Audit_ADVISOR_H
+
+#include "postgres.h"
+#include "nodes/params.h"
+#include "nodes/parsenodes.h"
+#include "nodes/plannodes.h"
+
+void  checkIndexBuild(IndexStmt *stmt);
+void  checkColumnAlignment(CreateStmt *stmt);
+void  checkRowWidth(CreateStmt *stmt);
+void  checkCreateTableAs(CreateTableAsStmt *stmt, ParamListInfo params, bool verbose);
+PlannedStmt *takeCtasPlan(Query *parse, int cursorOptions, ParamListInfo boundParams);
+void  forgetCtasPlan(void);
+void  checkCreateTrigger(CreateTrigStmt *stmt);
+char *prettySize(int64 bytes);
+
+#endif
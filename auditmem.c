@@ -0,0 +1,248 @@
+/* -------------------------------------------------------------------------
+ *
+ * auditmem.c
+ *
+ *   审核用的内存上下文．
+ *
+ *   checkRule()，dispCreateStmt()，transformCreateStmt() 的结果，
+ * NameListToString() 等审核时的分配以前都落在调用者的上下文里，
+ * 这个上下文要到整条语句，甚至整个多语句脚本结束才释放．
+ *   现在每条语句的审核都在 "pgsword audit" 上下文里进行，审核结束
+ * (或者出错) 时整体重置，后端内存不会随脚本长度增长．
+ *
+ *   审核可能嵌套 (审核中的 SPI 查询又会经过 post_parse_analyze)，
+ * 只有最外层的审核开始和结束时才重置．出错时由事务/子事务回调
+ * 恢复嵌套深度．
+ *
+ *   auditMemoryCheck() 在审核的各个阶段之间统计上下文的大小，
+ * 超过 pgsword.audit_memory_limit 时报错，作为这条语句的审核结果，
+ * 而不是让后端无限制地增长．
+ *
+ * Copyright (c) 2017-2017, Qunar DBA Group
+ *
+ * IDENTIFICATION
+ *      contrib/pgsword/auditmem.c
+ *
+ * -------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "access/htup_details.h"
+#include "access/xact.h"
+#include "funcapi.h"
+#include "nodes/memnodes.h"
+#include "utils/memutils.h"
+
+#include "pgsword.h"
+#include "advisor.h"
+#include "auditmem.h"
+
+/* 子事务开始时的嵌套深度 */
+typedef struct AuditDepthSave {
+    SubTransactionId        subid;
+    int                     depth;
+    struct AuditDepthSave  *next;
+} AuditDepthSave;
+
+static MemoryContext     auditContext = NULL;
+static int               auditDepth = 0;
+static AuditDepthSave   *auditDepthStack = NULL;
+static AuditMemoryStats  stats;
+
+PG_FUNCTION_INFO_V1(pgsword_audit_stats);
+
+/* 上下文和所有子上下文向操作系统申请的内存 */
+static int64 contextTotalSpace(MemoryContext cxt) {
+    MemoryContextCounters totals;
+    MemoryContext         child;
+    int64                 total;
+
+    memset(&totals, 0, sizeof(totals));
+    cxt->methods->stats(cxt, 0, false, &totals);
+    total = totals.totalspace;
+
+    for ( child = cxt->firstchild; child != NULL; child = child->nextchild ) {
+        total += contextTotalSpace(child);
+    }
+
+    return total;
+}
+
+static int64 auditMemoryUsed(void) {
+    int64 used = contextTotalSpace(auditContext);
+
+    stats.lastBytes = used;
+    if ( used > stats.peakBytes ) {
+        stats.peakBytes = used;
+    }
+
+    return used;
+}
+
+static void auditMemoryReset(void) {
+    if ( auditContext != NULL ) {
+        MemoryContextReset(auditContext);
+    }
+}
+
+static void auditXactCallback(XactEvent event, void *arg) {
+    AuditDepthSave *save;
+
+    if ( event != XACT_EVENT_ABORT && event != XACT_EVENT_PARALLEL_ABORT
+        && event != XACT_EVENT_COMMIT && event != XACT_EVENT_PARALLEL_COMMIT
+        && event != XACT_EVENT_PREPARE ) {
+        return;
+    }
+
+    while ( auditDepthStack != NULL ) {
+        save = auditDepthStack;
+        auditDepthStack = save->next;
+        pfree(save);
+    }
+
+    if ( auditDepth > 0 ) {
+        auditDepth = 0;
+        auditMemoryReset();
+    }
+}
+
+/*
+ * 只在审核中开始的子事务才记录开始时的深度，审核以外的子事务
+ * (比如 PL/pgSQL 的每个 EXCEPTION 块) 不分配内存．没有记录的子事务
+ * 开始时的深度就是 0．
+ */
+static void auditSubXactCallback(SubXactEvent event, SubTransactionId mySubid,
+                                 SubTransactionId parentSubid, void *arg) {
+    AuditDepthSave *save;
+    int             startDepth = 0;
+
+    switch ( event ) {
+        case SUBXACT_EVENT_START_SUB:
+            if ( auditDepth == 0 ) {
+                return;
+            }
+            save = MemoryContextAlloc(TopMemoryContext, sizeof(AuditDepthSave));
+            save->subid = mySubid;
+            save->depth = auditDepth;
+            save->next = auditDepthStack;
+            auditDepthStack = save;
+            break;
+
+        case SUBXACT_EVENT_COMMIT_SUB:
+        case SUBXACT_EVENT_ABORT_SUB:
+            if ( auditDepth == 0 && auditDepthStack == NULL ) {
+                return;
+            }
+
+            // 子事务 id 递增，比自己大的是已经结束的子事务留下的
+            while ( auditDepthStack != NULL && auditDepthStack->subid >= mySubid ) {
+                save = auditDepthStack;
+                auditDepthStack = save->next;
+                startDepth = save->subid == mySubid ? save->depth : 0;
+                pfree(save);
+            }
+
+            // 出错跳出了审核，回到子事务开始时的深度
+            if ( event == SUBXACT_EVENT_ABORT_SUB && startDepth < auditDepth ) {
+                auditDepth = startDepth;
+                if ( auditDepth == 0 ) {
+                    auditMemoryReset();
+                }
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+void initAuditMemory(void) {
+    RegisterXactCallback(auditXactCallback, NULL);
+    RegisterSubXactCallback(auditSubXactCallback, NULL);
+}
+
+/*
+ * auditMemoryBegin - 开始审核一条语句，切换到审核上下文
+ *
+ *   返回原来的上下文，交给 auditMemoryEnd()．
+ */
+MemoryContext auditMemoryBegin(void) {
+    if ( auditContext == NULL ) {
+        auditContext = AllocSetContextCreate(TopMemoryContext,
+                                             "pgsword audit",
+                                             ALLOCSET_DEFAULT_SIZES);
+    }
+
+    if ( auditDepth == 0 ) {
+        auditMemoryReset();
+        stats.statements++;
+    }
+    auditDepth++;
+
+    return MemoryContextSwitchTo(auditContext);
+}
+
+/* 审核的各个阶段之间调用，超过 pgsword.audit_memory_limit 时报错 */
+void auditMemoryCheck(void) {
+    int64 used;
+
+    if ( auditContext == NULL || auditDepth == 0 ) {
+        return;
+    }
+
+    used = auditMemoryUsed();
+
+    if ( pgsword_audit_memory_limit >= 0 && used > (int64) pgsword_audit_memory_limit * 1024 ) {
+        stats.limitHits++;
+        ereport(ERROR,
+                (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+                    errmsg("QunarSQLAudit: auditing this statement used %s, "
+                           "more than pgsword.audit_memory_limit (%s)",
+                           prettySize(used),
+                           prettySize((int64) pgsword_audit_memory_limit * 1024)),
+                    errhint("split the statement, or raise pgsword.audit_memory_limit")));
+    }
+}
+
+/* 结束审核，切回原来的上下文，最外层的审核结束时重置审核上下文 */
+void auditMemoryEnd(MemoryContext oldcxt) {
+    MemoryContextSwitchTo(oldcxt);
+
+    if ( auditDepth == 0 ) {
+        return;
+    }
+
+    auditDepth--;
+    if ( auditDepth == 0 ) {
+        auditMemoryUsed();
+        auditMemoryReset();
+    }
+}
+
+AuditMemoryStats *auditMemoryStats(void) {
+    return &stats;
+}
+
+/*
+ * pgsword_audit_stats - 本后端的审核统计
+ *
+ *   pgsword_audit_script() 的后台进程的统计会合并进来．
+ */
+Datum pgsword_audit_stats(PG_FUNCTION_ARGS) {
+    TupleDesc tupdesc;
+    Datum     values[4];
+    bool      nulls[4];
+
+    if ( get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE ) {
+        elog(ERROR, "return type must be a row type");
+    }
+    tupdesc = BlessTupleDesc(tupdesc);
+
+    memset(nulls, 0, sizeof(nulls));
+    values[0] = Int64GetDatum(stats.statements);
+    values[1] = Int64GetDatum(stats.peakBytes);
+    values[2] = Int64GetDatum(stats.lastBytes);
+    values[3] = Int64GetDatum(stats.limitHits);
+
+    PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
@@ -0,0 +1,23 @@
+#ifndef _Qunar_SQL_Audit_AUDITMEM_H
+#define _Qunar_SQL_Audit_AUDITMEM_H
+
+#include "postgres.h"
+#include "fmgr.h"
+
+/* 本后端审核用内存的统计 */
+typedef struct AuditMemoryStats {
+    int64   statements;     // 审核过的语句数
+    int64   peakBytes;      // 单条语句审核用到的最大内存
+    int64   lastBytes;      // 上一条语句审核用到的内存
+    int64   limitHits;      // 超过 pgsword.audit_memory_limit 的次数
+} AuditMemoryStats;
+
+void              initAuditMemory(void);
+MemoryContext     auditMemoryBegin(void);
+void              auditMemoryCheck(void);
+void              auditMemoryEnd(MemoryContext oldcxt);
+AuditMemoryStats *auditMemoryStats(void);
+
+PGDLLEXPORT Datum pgsword_audit_stats(PG_FUNCTION_ARGS);
+
+#endif
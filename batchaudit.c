@@ -0,0 +1,972 @@
+/* -------------------------------------------------------------------------
+ *
+ * batchaudit.c
+ *
+ *   在服务器内审核整个脚本：pgsword_audit_script(text)．
+ *
+ *   脚本里的每条语句按 pgsword.enabled 打开时的逻辑审核 (DDL 走
+ * my_process_utility，DML 走 post_parse_analyze)，但不真正执行，
+ * 审核中的 NOTICE/WARNING/ERROR 都收集起来，按语句顺序返回．
+ *
+ *   几万条语句的迁移脚本 (生成的分区 DDL，schema dump) 单个后端
+ * 审核会跑满一个 CPU．语句足够多时，把语句分成几块放进 DSM，
+ * 由动态后台进程并行审核，结果通过 shm_mq 送回来再按语句顺序合并：
+ *     - 涉及同一个表的语句 (包括外键引用的表) 分在同一块里，
+ *       并保持原来的顺序；
+ *     - 后台进程以当前用户连接当前数据库，继承当前会话的 GUC；
+ *     - 启动不了的后台进程，它的那一块由当前后端自己审核．
+ *
+ * Copyright (c) 2017-2017, Qunar DBA Group
+ *
+ * IDENTIFICATION
+ *      contrib/pgsword/batchaudit.c
+ *
+ * -------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include <signal.h>
+
+#include "access/htup_details.h"
+#include "access/xact.h"
+#include "funcapi.h"
+#include "lib/stringinfo.h"
+#include "miscadmin.h"
+#include "nodes/parsenodes.h"
+#include "parser/analyze.h"
+#include "parser/parser.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "storage/dsm.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/proc.h"
+#include "storage/shm_mq.h"
+#include "storage/shm_toc.h"
+#include "tcop/dest.h"
+#include "tcop/tcopprot.h"
+#include "tcop/utility.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+#include "utils/resowner.h"
+#include "utils/snapmgr.h"
+#include "utils/tuplestore.h"
+
+#include "pgsword.h"
+#include "auditmem.h"
+#include "batchaudit.h"
+#include "tools.h"
+
+#define PGSWORD_AUDIT_MAGIC     0x50475357
+
+#define AUDIT_KEY_HEADER        0
+#define AUDIT_KEY_GUC           1
+#define AUDIT_KEY_CHUNK(i)      (1000 + (i))
+#define AUDIT_KEY_QUEUE(i)      (2000 + (i))
+
+#define AUDIT_QUEUE_SIZE        (64 * 1024)
+
+/* 每个后台进程至少分到这么多条语句，再少就不值得启动 */
+#define AUDIT_MIN_CHUNK         200
+
+/* 一个后台进程结束时发送的 stmtno */
+#define AUDIT_DONE              (-1)
+
+typedef struct AuditHeader {
+    Oid   dboid;
+    Oid   authuserid;       // 连接用的用户
+    Oid   userid;           // 审核时的当前用户
+    int   secctx;
+    int   nworkers;
+} AuditHeader;
+
+/* 一个后台进程分到的语句，stmtno 后面是语句文本 */
+typedef struct AuditChunk {
+    int   nstmts;
+    Size  textlen;
+    int   stmtno[FLEXIBLE_ARRAY_MEMBER];
+} AuditChunk;
+
+#define AuditChunkText(c)   ((char *) &(c)->stmtno[(c)->nstmts])
+
+typedef struct AuditFinding {
+    int    stmtno;
+    int    seq;             // 同一条语句内的先后
+    int    elevel;
+    char  *message;
+    char  *detail;
+    char  *hint;
+} AuditFinding;
+
+typedef struct AuditCollector {
+    MemoryContext   cxt;
+    AuditFinding   *items;
+    int             nitems;
+    int             maxitems;
+    shm_mq_handle  *mqh;    // 后台进程里每条语句审核完就发给 leader
+} AuditCollector;
+
+/* 后台进程结束时发送，带上它的审核内存统计 */
+typedef struct AuditDoneMsg {
+    int     stmtno;         // AUDIT_DONE
+    int     elevel;
+    int64   statements;
+    int64   peakBytes;
+    int64   limitHits;
+} AuditDoneMsg;
+
+/* 按表名分组用的 hash 表 */
+typedef struct RelGroupEntry {
+    char  relname[NAMEDATALEN];
+    int   stmt;
+} RelGroupEntry;
+
+static emit_log_hook_type prev_emit_log_hook = NULL;
+
+/* 非 NULL 时表示正在审核，日志钩子把消息收集到这里 */
+static AuditCollector *auditCollector = NULL;
+static int             auditStmtNo = 0;
+
+PG_FUNCTION_INFO_V1(pgsword_audit_script);
+
+/* 去掉 tools.c 里用来覆盖 "NOTICE:" 的退格 */
+static const char *cleanMessage(const char *msg) {
+    if ( msg == NULL ) {
+        return "";
+    }
+    while ( *msg == '\b' ) {
+        msg++;
+    }
+    return msg;
+}
+
+static void collectFinding(AuditCollector *c, int stmtno, int elevel,
+                           const char *message, const char *detail, const char *hint) {
+    MemoryContext oldcxt = MemoryContextSwitchTo(c->cxt);
+    AuditFinding *f;
+
+    if ( c->nitems >= c->maxitems ) {
+        c->maxitems = Max(c->maxitems * 2, 64);
+        c->items = c->items == NULL
+                   ? palloc(sizeof(AuditFinding) * c->maxitems)
+                   : repalloc(c->items, sizeof(AuditFinding) * c->maxitems);
+    }
+
+    f = &c->items[c->nitems];
+    f->stmtno = stmtno;
+    f->seq = c->nitems;
+    f->elevel = elevel;
+    f->message = pstrdup(cleanMessage(message));
+    f->detail = detail ? pstrdup(detail) : NULL;
+    f->hint = hint ? pstrdup(hint) : NULL;
+    c->nitems++;
+
+    MemoryContextSwitchTo(oldcxt);
+}
+
+/* 审核中的 NOTICE/WARNING 不输出，收集起来 */
+static void auditEmitLog(ErrorData *edata) {
+    if ( auditCollector != NULL && edata->elevel >= NOTICE && edata->elevel < ERROR ) {
+        collectFinding(auditCollector, auditStmtNo, edata->elevel,
+                       edata->message, edata->detail, edata->hint);
+        edata->output_to_server = false;
+        edata->output_to_client = false;
+    }
+
+    if ( prev_emit_log_hook ) {
+        prev_emit_log_hook(edata);
+    }
+}
+
+void initBatchAudit(void) {
+    prev_emit_log_hook = emit_log_hook;
+    emit_log_hook = auditEmitLog;
+}
+
+/*
+ * auditStatement - 审核一条语句，不执行
+ *
+ *   在子事务里打开 pgsword.enabled 调用审核逻辑，最后总是回滚子事务．
+ *   log_min_messages 临时调到 notice，否则 NOTICE 不会经过日志钩子．
+ *   取消，关闭，内存不足不是审核结果，回滚子事务后继续抛出．
+ */
+static void auditStatement(RawStmt *raw, const char *queryString, int stmtno,
+                           AuditCollector *collector) {
+    MemoryContext oldcxt = CurrentMemoryContext;
+    ResourceOwner oldowner = CurrentResourceOwner;
+
+    // 留在子事务的上下文里，语句的分析结果随子事务回滚一起释放
+    BeginInternalSubTransaction(NULL);
+
+    PG_TRY();
+    {
+        SetConfigOption("pgsword.enabled", "on", PGC_SUSET, PGC_S_SESSION);
+        SetConfigOption("log_min_messages", "notice", PGC_SUSET, PGC_S_SESSION);
+
+        auditCollector = collector;
+        auditStmtNo = stmtno;
+
+        switch ( nodeTag(raw->stmt) ) {
+            case T_SelectStmt:
+            case T_InsertStmt:
+            case T_UpdateStmt:
+            case T_DeleteStmt:
+                parse_analyze(raw, queryString, NULL, 0, NULL);
+                break;
+
+            default: {
+                PlannedStmt *pstmt = makeNode(PlannedStmt);
+
+                pstmt->commandType = CMD_UTILITY;
+                pstmt->canSetTag = true;
+                pstmt->utilityStmt = raw->stmt;
+                pstmt->stmt_location = raw->stmt_location;
+                pstmt->stmt_len = raw->stmt_len;
+
+                ProcessUtility(pstmt, queryString, PROCESS_UTILITY_TOPLEVEL,
+                               NULL, NULL, None_Receiver, NULL);
+                break;
+            }
+        }
+
+        auditCollector = NULL;
+    }
+    PG_CATCH();
+    {
+        ErrorData *edata;
+
+        auditCollector = NULL;
+
+        MemoryContextSwitchTo(oldcxt);
+        edata = CopyErrorData();
+        FlushErrorState();
+
+        if ( edata->sqlerrcode == ERRCODE_QUERY_CANCELED
+            ||
+             edata->sqlerrcode == ERRCODE_ADMIN_SHUTDOWN
+            ||
+             edata->sqlerrcode == ERRCODE_CRASH_SHUTDOWN
+            ||
+             edata->sqlerrcode == ERRCODE_OUT_OF_MEMORY ) {
+            RollbackAndReleaseCurrentSubTransaction();
+            MemoryContextSwitchTo(oldcxt);
+            CurrentResourceOwner = oldowner;
+            ReThrowError(edata);
+        }
+
+        if ( edata->message == NULL || strstr(edata->message, AUDIT_OK_MSG) == NULL ) {
+            collectFinding(collector, stmtno, ERROR,
+                           edata->message, edata->detail, edata->hint);
+        }
+        FreeErrorData(edata);
+    }
+    PG_END_TRY();
+
+    RollbackAndReleaseCurrentSubTransaction();
+    MemoryContextSwitchTo(oldcxt);
+    CurrentResourceOwner = oldowner;
+}
+
+/* 后台进程把收集到的结果发给 leader */
+static void flushFindings(AuditCollector *c) {
+    StringInfoData buf;
+    int            i;
+
+    initStringInfo(&buf);
+
+    for ( i = 0; i < c->nitems; i++ ) {
+        AuditFinding *f = &c->items[i];
+
+        resetStringInfo(&buf);
+        appendBinaryStringInfo(&buf, (char *) &f->stmtno, sizeof(int));
+        appendBinaryStringInfo(&buf, (char *) &f->elevel, sizeof(int));
+        appendBinaryStringInfo(&buf, f->message, strlen(f->message) + 1);
+        appendBinaryStringInfo(&buf, f->detail ? f->detail : "", (f->detail ? strlen(f->detail) : 0) + 1);
+        appendBinaryStringInfo(&buf, f->hint ? f->hint : "", (f->hint ? strlen(f->hint) : 0) + 1);
+
+        if ( shm_mq_send(c->mqh, buf.len, buf.data, false) != SHM_MQ_SUCCESS ) {
+            ereport(ERROR,
+                    (errcode(ERRCODE_ADMIN_SHUTDOWN),
+                        errmsg("pgsword: audit leader has gone away")));
+        }
+    }
+
+    pfree(buf.data);
+    c->nitems = 0;
+    MemoryContextReset(c->cxt);
+    c->items = NULL;
+    c->maxitems = 0;
+}
+
+/* 审核一块语句，leader 和后台进程共用 */
+static void auditChunk(AuditChunk *chunk, AuditCollector *collector) {
+    char     *text = AuditChunkText(chunk);
+    List     *raws;
+    ListCell *lc;
+    int       i = 0;
+
+    raws = raw_parser(text);
+    if ( list_length(raws) != chunk->nstmts ) {
+        elog(ERROR, "pgsword: audit chunk has %d statements, expected %d",
+             list_length(raws), chunk->nstmts);
+    }
+
+    foreach(lc, raws) {
+        auditStatement((RawStmt *) lfirst(lc), text, chunk->stmtno[i++], collector);
+
+        if ( collector->mqh != NULL ) {
+            flushFindings(collector);
+        }
+        CHECK_FOR_INTERRUPTS();
+    }
+}
+
+/* ---------------------------------------------------------------------- */
+/* 按表分组                                                                 */
+/* ---------------------------------------------------------------------- */
+
+static void addRangeVar(List **names, RangeVar *rv) {
+    if ( rv != NULL && rv->relname != NULL ) {
+        *names = lappend(*names, rv->relname);
+    }
+}
+
+static void addConstraints(List **names, List *constraints) {
+    ListCell *lc;
+
+    foreach(lc, constraints) {
+        Node *n = (Node *) lfirst(lc);
+
+        if ( IsA(n, Constraint) && ((Constraint *) n)->contype == CONSTR_FOREIGN ) {
+            addRangeVar(names, ((Constraint *) n)->pktable);
+        }
+    }
+}
+
+static void addTableElts(List **names, List *elts) {
+    ListCell *lc;
+
+    foreach(lc, elts) {
+        Node *n = (Node *) lfirst(lc);
+
+        if ( IsA(n, ColumnDef) ) {
+            addConstraints(names, ((ColumnDef *) n)->constraints);
+        }
+        else if ( IsA(n, Constraint) ) {
+            addConstraints(names, list_make1(n));
+        }
+    }
+}
+
+/* 一条语句涉及的表名，同名的语句必须在同一个后台进程里按顺序审核 */
+static List *stmtRelnames(Node *stmt) {
+    List     *names = NIL;
+    ListCell *lc;
+
+    switch ( nodeTag(stmt) ) {
+        case T_CreateStmt: {
+            CreateStmt *cs = (CreateStmt *) stmt;
+
+            addRangeVar(&names, cs->relation);
+            foreach(lc, cs->inhRelations) {
+                addRangeVar(&names, (RangeVar *) lfirst(lc));
+            }
+            addTableElts(&names, cs->tableElts);
+            addConstraints(&names, cs->constraints);
+            break;
+        }
+
+        case T_AlterTableStmt: {
+            AlterTableStmt *as = (AlterTableStmt *) stmt;
+
+            addRangeVar(&names, as->relation);
+            foreach(lc, as->cmds) {
+                AlterTableCmd *cmd = (AlterTableCmd *) lfirst(lc);
+
+                if ( cmd->def != NULL ) {
+                    addTableElts(&names, list_make1(cmd->def));
+                }
+            }
+            break;
+        }
+
+        case T_DropStmt: {
+            DropStmt *ds = (DropStmt *) stmt;
+
+            if ( ds->removeType == OBJECT_TABLE || ds->removeType == OBJECT_VIEW
+                || ds->removeType == OBJECT_MATVIEW || ds->removeType == OBJECT_INDEX
+                || ds->removeType == OBJECT_SEQUENCE || ds->removeType == OBJECT_FOREIGN_TABLE ) {
+                foreach(lc, ds->objects) {
+                    names = lappend(names, strVal(llast((List *) lfirst(lc))));
+                }
+            }
+            break;
+        }
+
+        case T_TruncateStmt:
+            foreach(lc, ((TruncateStmt *) stmt)->relations) {
+                addRangeVar(&names, (RangeVar *) lfirst(lc));
+            }
+            break;
+
+        case T_IndexStmt:
+            addRangeVar(&names, ((IndexStmt *) stmt)->relation);
+            break;
+        case T_CreateTrigStmt:
+            addRangeVar(&names, ((CreateTrigStmt *) stmt)->relation);
+            break;
+        case T_RuleStmt:
+            addRangeVar(&names, ((RuleStmt *) stmt)->relation);
+            break;
+        case T_ViewStmt:
+            addRangeVar(&names, ((ViewStmt *) stmt)->view);
+            break;
+        case T_CreateTableAsStmt:
+            addRangeVar(&names, ((CreateTableAsStmt *) stmt)->into->rel);
+            break;
+        case T_RenameStmt:
+            addRangeVar(&names, ((RenameStmt *) stmt)->relation);
+            break;
+        case T_VacuumStmt:
+            addRangeVar(&names, ((VacuumStmt *) stmt)->relation);
+            break;
+        case T_ClusterStmt:
+            addRangeVar(&names, ((ClusterStmt *) stmt)->relation);
+            break;
+        case T_ReindexStmt:
+            addRangeVar(&names, ((ReindexStmt *) stmt)->relation);
+            break;
+        case T_CopyStmt:
+            addRangeVar(&names, ((CopyStmt *) stmt)->relation);
+            break;
+        case T_InsertStmt:
+            addRangeVar(&names, ((InsertStmt *) stmt)->relation);
+            break;
+        case T_UpdateStmt:
+            addRangeVar(&names, ((UpdateStmt *) stmt)->relation);
+            break;
+        case T_DeleteStmt:
+            addRangeVar(&names, ((DeleteStmt *) stmt)->relation);
+            break;
+
+        default:
+            break;
+    }
+
+    return names;
+}
+
+static int findRoot(int *parent, int i) {
+    while ( parent[i] != i ) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+typedef struct GroupSize {
+    int root;
+    int size;
+} GroupSize;
+
+static int groupSizeCmp(const void *a, const void *b) {
+    const GroupSize *ga = (const GroupSize *) a;
+    const GroupSize *gb = (const GroupSize *) b;
+
+    if ( ga->size != gb->size ) {
+        return gb->size - ga->size;
+    }
+    return ga->root - gb->root;
+}
+
+/*
+ * 把语句分配给 nworkers 个后台进程，结果写进 assign[]．
+ *   涉及同一个表的语句用并查集合并成一组，
+ * 再按组的大小从大到小分给当前最空闲的后台进程．
+ */
+static void assignStatements(RawStmt **stmts, int nstmts, int nworkers, int *assign) {
+    HASHCTL     ctl;
+    HTAB       *relGroups;
+    int        *parent = palloc(sizeof(int) * nstmts);
+    int        *groupWorker = palloc(sizeof(int) * nstmts);
+    int        *load = palloc0(sizeof(int) * nworkers);
+    GroupSize  *groups = palloc0(sizeof(GroupSize) * nstmts);
+    int         ngroups = 0;
+    int         i;
+
+    memset(&ctl, 0, sizeof(ctl));
+    ctl.keysize = NAMEDATALEN;
+    ctl.entrysize = sizeof(RelGroupEntry);
+    ctl.hcxt = CurrentMemoryContext;
+    relGroups = hash_create("pgsword audit relation groups", 1024, &ctl,
+                            HASH_ELEM | HASH_CONTEXT);
+
+    for ( i = 0; i < nstmts; i++ ) {
+        List     *names = stmtRelnames(stmts[i]->stmt);
+        ListCell *lc;
+
+        parent[i] = i;
+
+        foreach(lc, names) {
+            char           key[NAMEDATALEN];
+            RelGroupEntry *entry;
+            bool           found;
+
+            memset(key, 0, sizeof(key));
+            strlcpy(key, (char *) lfirst(lc), NAMEDATALEN);
+
+            entry = hash_search(relGroups, key, HASH_ENTER, &found);
+            if ( !found ) {
+                entry->stmt = i;
+            }
+            else {
+                int a = findRoot(parent, i);
+                int b = findRoot(parent, entry->stmt);
+
+                if ( a != b ) {
+                    parent[Max(a, b)] = Min(a, b);
+                }
+            }
+        }
+        list_free(names);
+    }
+
+    for ( i = 0; i < nstmts; i++ ) {
+        groups[findRoot(parent, i)].size++;
+    }
+    for ( i = 0; i < nstmts; i++ ) {
+        if ( groups[i].size > 0 ) {
+            groups[ngroups].root = i;
+            groups[ngroups].size = groups[i].size;
+            ngroups++;
+        }
+    }
+
+    qsort(groups, ngroups, sizeof(GroupSize), groupSizeCmp);
+
+    for ( i = 0; i < ngroups; i++ ) {
+        int best = 0;
+        int w;
+
+        for ( w = 1; w < nworkers; w++ ) {
+            if ( load[w] < load[best] ) {
+                best = w;
+            }
+        }
+        groupWorker[groups[i].root] = best;
+        load[best] += groups[i].size;
+    }
+
+    for ( i = 0; i < nstmts; i++ ) {
+        assign[i] = groupWorker[findRoot(parent, i)];
+    }
+
+    hash_destroy(relGroups);
+    pfree(parent);
+    pfree(groupWorker);
+    pfree(load);
+    pfree(groups);
+}
+
+/* 语句在原脚本里的文本 */
+static void appendStmtText(StringInfo buf, const char *script, RawStmt *raw) {
+    int len = raw->stmt_len > 0 ? raw->stmt_len : (int) strlen(script + raw->stmt_location);
+
+    // 分号单独一行，语句末尾的 -- 注释不会把它吞掉
+    appendBinaryStringInfo(buf, script + raw->stmt_location, len);
+    appendStringInfoString(buf, "\n;\n");
+}
+
+/* ---------------------------------------------------------------------- */
+/* leader                                                                 */
+/* ---------------------------------------------------------------------- */
+
+static void receiveFinding(AuditCollector *c, char *data, Size nbytes, bool *done) {
+    int         stmtno;
+    int         elevel;
+    const char *message;
+    const char *detail;
+    const char *hint;
+
+    memcpy(&stmtno, data, sizeof(int));
+    memcpy(&elevel, data + sizeof(int), sizeof(int));
+
+    if ( stmtno == AUDIT_DONE ) {
+        AuditMemoryStats *stats = auditMemoryStats();
+        AuditDoneMsg      msg;
+
+        memcpy(&msg, data, Min(nbytes, sizeof(AuditDoneMsg)));
+        stats->statements += msg.statements;
+        stats->peakBytes = Max(stats->peakBytes, msg.peakBytes);
+        stats->limitHits += msg.limitHits;
+
+        *done = true;
+        return;
+    }
+
+    message = data + 2 * sizeof(int);
+    detail = message + strlen(message) + 1;
+    hint = detail + strlen(detail) + 1;
+
+    collectFinding(c, stmtno, elevel, message,
+                   detail[0] ? detail : NULL, hint[0] ? hint : NULL);
+}
+
+/* 并行审核，结果放进 collector */
+static void auditParallel(const char *script, RawStmt **stmts, int nstmts, int nworkers,
+                          AuditCollector *collector) {
+    int                        *assign = palloc(sizeof(int) * nstmts);
+    StringInfoData             *texts = palloc(sizeof(StringInfoData) * nworkers);
+    int                        *counts = palloc0(sizeof(int) * nworkers);
+    shm_toc_estimator           e;
+    Size                        gucsize;
+    dsm_segment                *seg;
+    shm_toc                    *toc;
+    AuditHeader                *hdr;
+    AuditChunk                **chunks = palloc(sizeof(AuditChunk *) * nworkers);
+    shm_mq_handle             **mqh = palloc0(sizeof(shm_mq_handle *) * nworkers);
+    BackgroundWorkerHandle    **handles = palloc0(sizeof(BackgroundWorkerHandle *) * nworkers);
+    bool                       *done = palloc0(sizeof(bool) * nworkers);
+    int                         nactive = 0;
+    int                         i;
+    int                         w;
+
+    assignStatements(stmts, nstmts, nworkers, assign);
+
+    for ( w = 0; w < nworkers; w++ ) {
+        initStringInfo(&texts[w]);
+    }
+    for ( i = 0; i < nstmts; i++ ) {
+        appendStmtText(&texts[assign[i]], script, stmts[i]);
+        counts[assign[i]]++;
+    }
+
+    gucsize = EstimateGUCStateSpace();
+
+    shm_toc_initialize_estimator(&e);
+    shm_toc_estimate_chunk(&e, sizeof(AuditHeader));
+    shm_toc_estimate_chunk(&e, gucsize);
+    for ( w = 0; w < nworkers; w++ ) {
+        shm_toc_estimate_chunk(&e, offsetof(AuditChunk, stmtno) + sizeof(int) * counts[w]
+                                   + texts[w].len + 1);
+        shm_toc_estimate_chunk(&e, AUDIT_QUEUE_SIZE);
+    }
+    shm_toc_estimate_keys(&e, 2 + 2 * nworkers);
+
+    seg = dsm_create(shm_toc_estimate(&e), 0);
+    toc = shm_toc_create(PGSWORD_AUDIT_MAGIC, dsm_segment_address(seg), shm_toc_estimate(&e));
+
+    hdr = shm_toc_allocate(toc, sizeof(AuditHeader));
+    hdr->dboid = MyDatabaseId;
+    hdr->authuserid = GetAuthenticatedUserId();
+    GetUserIdAndSecContext(&hdr->userid, &hdr->secctx);
+    hdr->nworkers = nworkers;
+    shm_toc_insert(toc, AUDIT_KEY_HEADER, hdr);
+
+    {
+        char *gucspace = shm_toc_allocate(toc, gucsize);
+
+        SerializeGUCState(gucsize, gucspace);
+        shm_toc_insert(toc, AUDIT_KEY_GUC, gucspace);
+    }
+
+    for ( w = 0; w < nworkers; w++ ) {
+        int k = 0;
+
+        chunks[w] = shm_toc_allocate(toc, offsetof(AuditChunk, stmtno) + sizeof(int) * counts[w]
+                                          + texts[w].len + 1);
+        chunks[w]->nstmts = counts[w];
+        chunks[w]->textlen = texts[w].len;
+        for ( i = 0; i < nstmts; i++ ) {
+            if ( assign[i] == w ) {
+                chunks[w]->stmtno[k++] = i + 1;
+            }
+        }
+        memcpy(AuditChunkText(chunks[w]), texts[w].data, texts[w].len + 1);
+        shm_toc_insert(toc, AUDIT_KEY_CHUNK(w), chunks[w]);
+        pfree(texts[w].data);
+    }
+
+    for ( w = 0; w < nworkers; w++ ) {
+        shm_mq           *mq = shm_mq_create(shm_toc_allocate(toc, AUDIT_QUEUE_SIZE), AUDIT_QUEUE_SIZE);
+        BackgroundWorker  worker;
+
+        shm_toc_insert(toc, AUDIT_KEY_QUEUE(w), mq);
+
+        if ( counts[w] == 0 ) {
+            done[w] = true;
+            continue;
+        }
+
+        shm_mq_set_receiver(mq, MyProc);
+
+        memset(&worker, 0, sizeof(worker));
+        worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+        worker.bgw_start_time = BgWorkerStart_ConsistentState;
+        worker.bgw_restart_time = BGW_NEVER_RESTART;
+        snprintf(worker.bgw_name, BGW_MAXLEN, "pgsword audit worker %d", w);
+        snprintf(worker.bgw_library_name, BGW_MAXLEN, "pgsword");
+        snprintf(worker.bgw_function_name, BGW_MAXLEN, "pgsword_audit_worker_main");
+        worker.bgw_main_arg = UInt32GetDatum(dsm_segment_handle(seg));
+        worker.bgw_notify_pid = MyProcPid;
+        memcpy(worker.bgw_extra, &w, sizeof(int));
+
+        if ( RegisterDynamicBackgroundWorker(&worker, &handles[w]) ) {
+            mqh[w] = shm_mq_attach(mq, seg, handles[w]);
+            nactive++;
+        }
+        else {
+            handles[w] = NULL;
+        }
+    }
+
+    // 没能启动的后台进程的那一块自己审核
+    for ( w = 0; w < nworkers; w++ ) {
+        if ( !done[w] && handles[w] == NULL ) {
+            ereport(DEBUG1,
+                    (errmsg("pgsword: no background worker slot, auditing chunk %d locally", w)));
+            auditChunk(chunks[w], collector);
+            done[w] = true;
+        }
+    }
+
+    while ( nactive > 0 ) {
+        bool progress = false;
+
+        for ( w = 0; w < nworkers; w++ ) {
+            shm_mq_result  res;
+            Size           nbytes;
+            void          *data;
+
+            if ( done[w] ) {
+                continue;
+            }
+
+            res = shm_mq_receive(mqh[w], &nbytes, &data, true);
+            if ( res == SHM_MQ_SUCCESS ) {
+                receiveFinding(collector, (char *) data, nbytes, &done[w]);
+                if ( done[w] ) {
+                    nactive--;
+                }
+                progress = true;
+            }
+            else if ( res == SHM_MQ_DETACHED ) {
+                collectFinding(collector, 0, ERROR,
+                               psprintf("pgsword: audit worker %d exited before finishing", w),
+                               NULL, "check the server log, or set pgsword.audit_workers = 0");
+                done[w] = true;
+                nactive--;
+                progress = true;
+            }
+        }
+
+        if ( !progress ) {
+            int rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_POSTMASTER_DEATH, -1L, PG_WAIT_EXTENSION);
+
+            if ( rc & WL_POSTMASTER_DEATH ) {
+                proc_exit(1);
+            }
+            ResetLatch(MyLatch);
+            CHECK_FOR_INTERRUPTS();
+        }
+    }
+
+    dsm_detach(seg);
+}
+
+static int findingCmp(const void *a, const void *b) {
+    const AuditFinding *fa = (const AuditFinding *) a;
+    const AuditFinding *fb = (const AuditFinding *) b;
+
+    if ( fa->stmtno != fb->stmtno ) {
+        return fa->stmtno < fb->stmtno ? -1 : 1;
+    }
+    return fa->seq < fb->seq ? -1 : (fa->seq > fb->seq ? 1 : 0);
+}
+
+static const char *severityName(int elevel) {
+    if ( elevel >= ERROR ) {
+        return "ERROR";
+    }
+    if ( elevel >= WARNING ) {
+        return "WARNING";
+    }
+    return "NOTICE";
+}
+
+/*
+ * pgsword_audit_script - 审核一个脚本，按语句顺序返回所有审核结果
+ *
+ *   stmt_no 从 1 开始；审核通过的语句只有 NOTICE，
+ * 不通过的有 ERROR．
+ */
+Datum pgsword_audit_script(PG_FUNCTION_ARGS) {
+    ReturnSetInfo   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    char            *script = text_to_cstring(PG_GETARG_TEXT_PP(0));
+    TupleDesc        tupdesc;
+    Tuplestorestate *tupstore;
+    MemoryContext    oldcontext;
+    AuditCollector   collector;
+    List            *raws;
+    RawStmt        **stmts;
+    ListCell        *lc;
+    int              nstmts;
+    int              nworkers;
+    int              i;
+
+    if ( rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo)
+        ||
+         !(rsinfo->allowedModes & SFRM_Materialize) ) {
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                    errmsg("set-valued function called in context that cannot accept a set")));
+    }
+
+    if ( get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE ) {
+        elog(ERROR, "return type must be a row type");
+    }
+
+    oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+    tupstore = tuplestore_begin_heap(true, false, work_mem);
+    rsinfo->returnMode = SFRM_Materialize;
+    rsinfo->setResult = tupstore;
+    rsinfo->setDesc = tupdesc;
+    MemoryContextSwitchTo(oldcontext);
+
+    memset(&collector, 0, sizeof(collector));
+    collector.cxt = AllocSetContextCreate(CurrentMemoryContext,
+                                          "pgsword audit findings",
+                                          ALLOCSET_DEFAULT_SIZES);
+
+    raws = raw_parser(script);
+    nstmts = list_length(raws);
+    stmts = palloc(sizeof(RawStmt *) * Max(nstmts, 1));
+    i = 0;
+    foreach(lc, raws) {
+        stmts[i++] = (RawStmt *) lfirst(lc);
+    }
+
+    // 不超过 max_parallel_workers，避免一个会话占满后台进程
+    nworkers = Min(Min(pgsword_audit_workers, max_parallel_workers), nstmts / AUDIT_MIN_CHUNK);
+
+    if ( nworkers <= 1 || IsInParallelMode() ) {
+        for ( i = 0; i < nstmts; i++ ) {
+            auditStatement(stmts[i], script, i + 1, &collector);
+            CHECK_FOR_INTERRUPTS();
+        }
+    }
+    else {
+        auditParallel(script, stmts, nstmts, nworkers, &collector);
+    }
+
+    qsort(collector.items, collector.nitems, sizeof(AuditFinding), findingCmp);
+
+    for ( i = 0; i < collector.nitems; i++ ) {
+        AuditFinding *f = &collector.items[i];
+        Datum         values[5];
+        bool          nulls[5];
+
+        memset(nulls, 0, sizeof(nulls));
+        values[0] = Int32GetDatum(f->stmtno);
+        values[1] = CStringGetTextDatum(severityName(f->elevel));
+        values[2] = CStringGetTextDatum(f->message);
+        if ( f->detail != NULL ) {
+            values[3] = CStringGetTextDatum(f->detail);
+        }
+        else {
+            nulls[3] = true;
+        }
+        if ( f->hint != NULL ) {
+            values[4] = CStringGetTextDatum(f->hint);
+        }
+        else {
+            nulls[4] = true;
+        }
+
+        tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+    }
+
+    MemoryContextDelete(collector.cxt);
+
+    return (Datum) 0;
+}
+
+/* ---------------------------------------------------------------------- */
+/* 后台进程                                                                 */
+/* ---------------------------------------------------------------------- */
+
+void pgsword_audit_worker_main(Datum main_arg) {
+    dsm_segment    *seg;
+    shm_toc        *toc;
+    AuditHeader    *hdr;
+    AuditChunk     *chunk;
+    shm_mq         *mq;
+    AuditCollector  collector;
+    AuditDoneMsg    done;
+    int             idx;
+
+    pqsignal(SIGTERM, die);
+    BackgroundWorkerUnblockSignals();
+
+    memcpy(&idx, MyBgworkerEntry->bgw_extra, sizeof(int));
+
+    CurrentResourceOwner = ResourceOwnerCreate(NULL, "pgsword audit worker");
+
+    seg = dsm_attach(DatumGetUInt32(main_arg));
+    if ( seg == NULL ) {
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                    errmsg("pgsword: could not map dynamic shared memory segment")));
+    }
+
+    toc = shm_toc_attach(PGSWORD_AUDIT_MAGIC, dsm_segment_address(seg));
+    if ( toc == NULL ) {
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                    errmsg("pgsword: bad magic number in dynamic shared memory segment")));
+    }
+
+    hdr = shm_toc_lookup(toc, AUDIT_KEY_HEADER, false);
+    chunk = shm_toc_lookup(toc, AUDIT_KEY_CHUNK(idx), false);
+    mq = shm_toc_lookup(toc, AUDIT_KEY_QUEUE(idx), false);
+
+    shm_mq_set_sender(mq, MyProc);
+
+    memset(&collector, 0, sizeof(collector));
+    collector.mqh = shm_mq_attach(mq, seg, NULL);
+    collector.cxt = AllocSetContextCreate(TopMemoryContext,
+                                          "pgsword audit findings",
+                                          ALLOCSET_DEFAULT_SIZES);
+
+    BackgroundWorkerInitializeConnectionByOid(hdr->dboid, hdr->authuserid);
+
+    // 继承 leader 的 GUC (search_path，pgsword.* 阈值等)
+    StartTransactionCommand();
+    RestoreGUCState(shm_toc_lookup(toc, AUDIT_KEY_GUC, false));
+    CommitTransactionCommand();
+
+    SetUserIdAndSecContext(hdr->userid, hdr->secctx);
+
+    StartTransactionCommand();
+    PushActiveSnapshot(GetTransactionSnapshot());
+    pgstat_report_activity(STATE_RUNNING, "pgsword audit");
+
+    auditChunk(chunk, &collector);
+
+    PopActiveSnapshot();
+    CommitTransactionCommand();
+    pgstat_report_activity(STATE_IDLE, NULL);
+
+    memset(&done, 0, sizeof(done));
+    done.stmtno = AUDIT_DONE;
+    done.statements = auditMemoryStats()->statements;
+    done.peakBytes = auditMemoryStats()->peakBytes;
+    done.limitHits = auditMemoryStats()->limitHits;
+    shm_mq_send(collector.mqh, sizeof(done), &done, false);
+    shm_mq_detach(collector.mqh);
+
+    dsm_detach(seg);
+    proc_exit(0);
+}
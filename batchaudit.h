@@ -0,0 +1,12 @@
+#ifndef _Qunar_SQL_Audit_BATCHAUDIT_H
+#define _Qunar_SQL_Audit_BATCHAUDIT_H
+
+#include "postgres.h"
+#include "fmgr.h"
+
+void initBatchAudit(void);
+
+PGDLLEXPORT Datum pgsword_audit_script(PG_FUNCTION_ARGS);
+PGDLLEXPORT void  pgsword_audit_worker_main(Datum main_arg);
+
+#endif
@@ -0,0 +1,570 @@
+/* -------------------------------------------------------------------------
+ *
+ * indexadvisor.c
+ *
+ *   找出没用的索引和重复的索引．
+ *
+ *   建索引时的审核挡不住已经存在的几百个历史索引，它们拖慢每一次写入．
+ * 后台进程 pgsword index advisor 定期采样 pg_stat_user_indexes 和
+ * pg_index，在共享内存里为每个索引保留一个 INDEX_SAMPLES 个槽的环形
+ * 缓冲区，记录 pgsword.index_advisor_window 时间窗口内的扫描次数变化．
+ * pgsword_index_report() 给出按写入代价排序的报告：
+ *     never scanned  窗口内一次也没被扫描过 (不含约束用的索引)
+ *     duplicate      和同一张表上的另一个索引定义完全相同
+ *     prefix         键是另一个索引的键的前缀
+ *
+ *   同时记录索引所在表的插入，更新，删除行数，审核行级触发器时用
+ * indexAdvisorTableWrites() 取窗口内的写入速度．
+ *
+ *   共享内存大小由 pgsword.index_advisor_max_indexes 固定，每次采样
+ * 只读 catalog 和统计信息，可以一直在主库上跑．
+ *
+ * Copyright (c) 2017-2017, Qunar DBA Group
+ *
+ * IDENTIFICATION
+ *      contrib/pgsword/indexadvisor.c
+ *
+ * -------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include <signal.h>
+
+#include "access/htup_details.h"
+#include "access/xact.h"
+#include "catalog/pg_type.h"
+#include "executor/spi.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "storage/proc.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/snapmgr.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+
+#include "pgsword.h"
+#include "indexadvisor.h"
+
+/* 每个索引在时间窗口内保留的采样数 */
+#define INDEX_SAMPLES          16
+
+#define INDEX_REPORT_COLS      8
+
+typedef struct IndexUsage {
+    Oid     indexrelid;
+    Oid     relid;
+    Oid     duplicateOf;    /* 定义完全相同，应保留的那个索引 */
+    Oid     prefixOf;       /* 键是它的前缀 */
+    bool    enforcing;      /* 主键，唯一，排他约束用的索引不能随便删 */
+    int64   size;
+    int64   scans[INDEX_SAMPLES];   /* idx_scan，-1 表示这个槽没有数据 */
+    int64   writes[INDEX_SAMPLES];  /* 表上要写索引的行数 */
+    int64   inserts[INDEX_SAMPLES]; /* 表上插入，更新，删除的行数 */
+    int64   updates[INDEX_SAMPLES];
+    int64   deletes[INDEX_SAMPLES];
+} IndexUsage;
+
+typedef struct IndexAdvisorShared {
+    LWLock     *lock;
+    Oid         dboid;              /* 采样的数据库 */
+    int         head;               /* 最新一次采样的槽 */
+    TimestampTz sampleTime[INDEX_SAMPLES];
+    int         nentries;
+    IndexUsage  entries[FLEXIBLE_ARRAY_MEMBER];    /* 按 indexrelid 排序 */
+} IndexAdvisorShared;
+
+static IndexAdvisorShared *advisorShared = NULL;
+
+PG_FUNCTION_INFO_V1(pgsword_index_report);
+
+static volatile sig_atomic_t got_sighup = false;
+static volatile sig_atomic_t got_sigterm = false;
+
+/*
+ * 一次采样只有一条查询．
+ *   写入代价：插入和非 HOT 更新都要往每个索引里插一条．
+ *   重复：同表，同键，同 opclass，同 collation，同表达式和谓词；
+ *         保留约束用的索引和唯一索引，都一样就保留 oid 小的．
+ *   前缀：普通 B-tree 索引的键 (连同 opclass 和 collation) 是另一个
+ *         同表索引的键的前缀．
+ *   主键，唯一约束，排他约束用的索引 (pg_constraint.conindid) 删不掉，
+ * 不会被当成重复或前缀．
+ */
+static const char *sampleSql =
+    "SELECT i.indexrelid, i.indrelid, s.idx_scan,"
+    "       t.n_tup_ins + t.n_tup_upd - t.n_tup_hot_upd,"
+    "       pg_catalog.pg_relation_size(i.indexrelid),"
+    "       i.indisunique OR i.indisprimary OR i.indisexclusion OR c.backing,"
+    "       (SELECT min(d.indexrelid) FROM pg_catalog.pg_index d"
+    "         WHERE d.indrelid = i.indrelid AND d.indexrelid <> i.indexrelid"
+    "           AND NOT c.backing"
+    "           AND d.indkey::text = i.indkey::text"
+    "           AND d.indclass::text = i.indclass::text"
+    "           AND d.indcollation::text = i.indcollation::text"
+    "           AND pg_catalog.pg_get_expr(d.indexprs, d.indrelid)"
+    "               IS NOT DISTINCT FROM pg_catalog.pg_get_expr(i.indexprs, i.indrelid)"
+    "           AND pg_catalog.pg_get_expr(d.indpred, d.indrelid)"
+    "               IS NOT DISTINCT FROM pg_catalog.pg_get_expr(i.indpred, i.indrelid)"
+    "           AND (d.indisprimary"
+    "                OR EXISTS (SELECT 1 FROM pg_catalog.pg_constraint k"
+    "                            WHERE k.conindid = d.indexrelid)"
+    "                OR (d.indisunique AND NOT i.indisunique)"
+    "                OR (d.indisunique = i.indisunique AND d.indexrelid < i.indexrelid))),"
+    "       (SELECT min(d.indexrelid) FROM pg_catalog.pg_index d"
+    "         WHERE d.indrelid = i.indrelid AND d.indexrelid <> i.indexrelid"
+    "           AND NOT c.backing"
+    "           AND NOT i.indisunique AND i.indexprs IS NULL AND i.indpred IS NULL"
+    "           AND d.indpred IS NULL AND d.indnatts > i.indnatts"
+    "           AND pg_catalog.array_to_string((d.indkey::pg_catalog.int2[])[0:i.indnatts - 1], ' ')"
+    "               = i.indkey::text"
+    "           AND pg_catalog.array_to_string((d.indclass::pg_catalog.oid[])[0:i.indnatts - 1], ' ')"
+    "               = i.indclass::text"
+    "           AND pg_catalog.array_to_string((d.indcollation::pg_catalog.oid[])[0:i.indnatts - 1], ' ')"
+    "               = i.indcollation::text),"
+    "       t.n_tup_ins, t.n_tup_upd, t.n_tup_del"
+    "  FROM pg_catalog.pg_index i"
+    "  CROSS JOIN LATERAL (SELECT i.indisprimary OR EXISTS"
+    "                        (SELECT 1 FROM pg_catalog.pg_constraint k"
+    "                          WHERE k.conindid = i.indexrelid) AS backing) c"
+    "  JOIN pg_catalog.pg_stat_user_indexes s ON s.indexrelid = i.indexrelid"
+    "  JOIN pg_catalog.pg_stat_user_tables t ON t.relid = i.indrelid"
+    " ORDER BY pg_catalog.pg_relation_size(i.indexrelid) DESC"
+    " LIMIT $1";
+
+Size indexAdvisorShmemSize(void) {
+    return add_size(offsetof(IndexAdvisorShared, entries),
+                    mul_size(pgsword_index_advisor_max_indexes, sizeof(IndexUsage)));
+}
+
+void indexAdvisorShmemInit(void) {
+    bool found;
+
+    advisorShared = ShmemInitStruct("pgsword index advisor",
+                                    indexAdvisorShmemSize(),
+                                    &found);
+    if ( !found ) {
+        memset(advisorShared, 0, indexAdvisorShmemSize());
+        advisorShared->lock = &(GetNamedLWLockTranche("pgsword")[0].lock);
+        advisorShared->head = INDEX_SAMPLES - 1;
+    }
+}
+
+static int indexUsageCmp(const void *a, const void *b) {
+    Oid oa = ((const IndexUsage *) a)->indexrelid;
+    Oid ob = ((const IndexUsage *) b)->indexrelid;
+
+    return oa < ob ? -1 : (oa > ob ? 1 : 0);
+}
+
+/*
+ * takeSample - 采样一次，写进环形缓冲区的下一个槽
+ *
+ *   fresh 是进程私有的缓冲区，容量固定为 pgsword.index_advisor_max_indexes，
+ * 拿锁期间只做内存拷贝和二分查找．
+ */
+static void takeSample(IndexUsage *fresh) {
+    Oid         argtypes[1] = { INT4OID };
+    Datum       values[1];
+    int         nfresh = 0;
+    int         slot;
+    int         i;
+    uint64      row;
+
+    SetCurrentStatementStartTimestamp();
+    StartTransactionCommand();
+    SPI_connect();
+    PushActiveSnapshot(GetTransactionSnapshot());
+    pgstat_report_activity(STATE_RUNNING, "pgsword: sample index usage");
+
+    values[0] = Int32GetDatum(pgsword_index_advisor_max_indexes);
+    if ( SPI_execute_with_args(sampleSql, 1, argtypes, values, NULL, true, 0) != SPI_OK_SELECT ) {
+        elog(ERROR, "pgsword: failed to sample index usage");
+    }
+
+    for ( row = 0; row < SPI_processed && nfresh < pgsword_index_advisor_max_indexes; row++ ) {
+        HeapTuple   tup = SPI_tuptable->vals[row];
+        TupleDesc   desc = SPI_tuptable->tupdesc;
+        IndexUsage *e = &fresh[nfresh++];
+        bool        isnull;
+        Datum       d;
+
+        memset(e, 0, sizeof(IndexUsage));
+        e->indexrelid = DatumGetObjectId(SPI_getbinval(tup, desc, 1, &isnull));
+        e->relid = DatumGetObjectId(SPI_getbinval(tup, desc, 2, &isnull));
+        d = SPI_getbinval(tup, desc, 3, &isnull);
+        e->scans[0] = isnull ? 0 : DatumGetInt64(d);
+        d = SPI_getbinval(tup, desc, 4, &isnull);
+        e->writes[0] = isnull ? 0 : DatumGetInt64(d);
+        e->size = DatumGetInt64(SPI_getbinval(tup, desc, 5, &isnull));
+        e->enforcing = DatumGetBool(SPI_getbinval(tup, desc, 6, &isnull));
+        d = SPI_getbinval(tup, desc, 7, &isnull);
+        e->duplicateOf = isnull ? InvalidOid : DatumGetObjectId(d);
+        d = SPI_getbinval(tup, desc, 8, &isnull);
+        e->prefixOf = isnull ? InvalidOid : DatumGetObjectId(d);
+        d = SPI_getbinval(tup, desc, 9, &isnull);
+        e->inserts[0] = isnull ? 0 : DatumGetInt64(d);
+        d = SPI_getbinval(tup, desc, 10, &isnull);
+        e->updates[0] = isnull ? 0 : DatumGetInt64(d);
+        d = SPI_getbinval(tup, desc, 11, &isnull);
+        e->deletes[0] = isnull ? 0 : DatumGetInt64(d);
+    }
+
+    SPI_finish();
+    PopActiveSnapshot();
+    CommitTransactionCommand();
+    pgstat_report_activity(STATE_IDLE, NULL);
+
+    qsort(fresh, nfresh, sizeof(IndexUsage), indexUsageCmp);
+
+    LWLockAcquire(advisorShared->lock, LW_EXCLUSIVE);
+
+    slot = (advisorShared->head + 1) % INDEX_SAMPLES;
+
+    for ( i = 0; i < nfresh; i++ ) {
+        IndexUsage *e = &fresh[i];
+        IndexUsage *old;
+        int64       scans = e->scans[0];
+        int64       writes = e->writes[0];
+        int64       inserts = e->inserts[0];
+        int64       updates = e->updates[0];
+        int64       deletes = e->deletes[0];
+        int         k;
+
+        old = bsearch(e, advisorShared->entries, advisorShared->nentries,
+                      sizeof(IndexUsage), indexUsageCmp);
+
+        // 新索引，或者统计信息被重置过：之前的采样作废
+        if ( old == NULL || old->scans[advisorShared->head] > scans ) {
+            for ( k = 0; k < INDEX_SAMPLES; k++ ) {
+                e->scans[k] = -1;
+                e->writes[k] = -1;
+                e->inserts[k] = -1;
+                e->updates[k] = -1;
+                e->deletes[k] = -1;
+            }
+        }
+        else {
+            memcpy(e->scans, old->scans, sizeof(e->scans));
+            memcpy(e->writes, old->writes, sizeof(e->writes));
+            memcpy(e->inserts, old->inserts, sizeof(e->inserts));
+            memcpy(e->updates, old->updates, sizeof(e->updates));
+            memcpy(e->deletes, old->deletes, sizeof(e->deletes));
+        }
+
+        e->scans[slot] = scans;
+        e->writes[slot] = writes;
+        e->inserts[slot] = inserts;
+        e->updates[slot] = updates;
+        e->deletes[slot] = deletes;
+    }
+
+    memcpy(advisorShared->entries, fresh, sizeof(IndexUsage) * nfresh);
+    advisorShared->nentries = nfresh;
+    advisorShared->dboid = MyDatabaseId;
+    advisorShared->sampleTime[slot] = GetCurrentTimestamp();
+    advisorShared->head = slot;
+
+    LWLockRelease(advisorShared->lock);
+}
+
+static void advisor_sighup(SIGNAL_ARGS) {
+    int save_errno = errno;
+
+    got_sighup = true;
+    SetLatch(MyLatch);
+
+    errno = save_errno;
+}
+
+static void advisor_sigterm(SIGNAL_ARGS) {
+    int save_errno = errno;
+
+    got_sigterm = true;
+    SetLatch(MyLatch);
+
+    errno = save_errno;
+}
+
+void registerIndexAdvisorWorker(void) {
+    BackgroundWorker worker;
+
+    memset(&worker, 0, sizeof(worker));
+    worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+    worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+    worker.bgw_restart_time = 60;
+    snprintf(worker.bgw_name, BGW_MAXLEN, "pgsword index advisor");
+    snprintf(worker.bgw_library_name, BGW_MAXLEN, "pgsword");
+    snprintf(worker.bgw_function_name, BGW_MAXLEN, "pgsword_index_advisor_main");
+    worker.bgw_main_arg = (Datum) 0;
+    worker.bgw_notify_pid = 0;
+
+    RegisterBackgroundWorker(&worker);
+}
+
+void pgsword_index_advisor_main(Datum main_arg) {
+    IndexUsage *fresh;
+
+    pqsignal(SIGHUP, advisor_sighup);
+    pqsignal(SIGTERM, advisor_sigterm);
+
+    BackgroundWorkerUnblockSignals();
+
+    BackgroundWorkerInitializeConnection(pgsword_index_advisor_database, NULL);
+
+    fresh = MemoryContextAlloc(TopMemoryContext,
+                               sizeof(IndexUsage) * pgsword_index_advisor_max_indexes);
+
+    while ( !got_sigterm ) {
+        int  rc;
+        long interval;
+
+        takeSample(fresh);
+
+        // 时间窗口内均匀采 INDEX_SAMPLES 次
+        interval = (long) pgsword_index_advisor_window * 1000L / (INDEX_SAMPLES - 1);
+
+        rc = WaitLatch(MyLatch,
+                       WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+                       interval,
+                       PG_WAIT_EXTENSION);
+        ResetLatch(MyLatch);
+
+        if ( rc & WL_POSTMASTER_DEATH ) {
+            proc_exit(1);
+        }
+
+        CHECK_FOR_INTERRUPTS();
+
+        if ( got_sighup ) {
+            got_sighup = false;
+            ProcessConfigFile(PGC_SIGHUP);
+        }
+    }
+
+    proc_exit(0);
+}
+
+/* 窗口内最早的有效采样的槽，没有返回 -1．调用方持有锁 */
+static int windowBase(IndexUsage *e, TimestampTz now) {
+    int64 windowUsecs = (int64) pgsword_index_advisor_window * USECS_PER_SEC;
+    int   head = advisorShared->head;
+    int   k;
+
+    if ( e->scans[head] < 0 ) {
+        return -1;
+    }
+
+    for ( k = 1; k <= INDEX_SAMPLES; k++ ) {
+        int s = (head + k) % INDEX_SAMPLES;
+
+        if ( e->scans[s] >= 0
+            &&
+             advisorShared->sampleTime[s] != 0
+            &&
+             now - advisorShared->sampleTime[s] <= windowUsecs ) {
+            return s;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * indexAdvisorTableWrites - 表在采样窗口内的插入，更新，删除行数
+ *
+ *   用表上任意一个被采样的索引的记录，observed 是窗口实际覆盖的秒数．
+ * 没有采样 (表上没有索引，不在采样的数据库，或者只采样过一次) 返回 false．
+ */
+bool indexAdvisorTableWrites(Oid relid, int64 *inserts, int64 *updates, int64 *deletes,
+                             double *observed) {
+    TimestampTz now = GetCurrentTimestamp();
+    bool        found = false;
+    int         head;
+    int         i;
+
+    if ( advisorShared == NULL ) {
+        return false;
+    }
+
+    LWLockAcquire(advisorShared->lock, LW_SHARED);
+
+    head = advisorShared->head;
+
+    for ( i = 0; i < advisorShared->nentries && advisorShared->dboid == MyDatabaseId; i++ ) {
+        IndexUsage *e = &advisorShared->entries[i];
+        int         base;
+
+        if ( e->relid != relid ) {
+            continue;
+        }
+
+        base = windowBase(e, now);
+        if ( base < 0 || base == head ) {
+            continue;
+        }
+
+        *inserts = e->inserts[head] - e->inserts[base];
+        *updates = e->updates[head] - e->updates[base];
+        *deletes = e->deletes[head] - e->deletes[base];
+        *observed = (double) (advisorShared->sampleTime[head] - advisorShared->sampleTime[base])
+                    / USECS_PER_SEC;
+        found = true;
+        break;
+    }
+
+    LWLockRelease(advisorShared->lock);
+
+    return found;
+}
+
+/* 报告里的一行 */
+typedef struct IndexFinding {
+    Oid     indexrelid;
+    Oid     relid;
+    const char *reason;
+    Oid     redundantTo;
+    int64   scans;
+    int64   size;
+    int64   writes;
+    double  observed;
+} IndexFinding;
+
+/* 写入代价高的排前面，一样就看大小 */
+static int indexFindingCmp(const void *a, const void *b) {
+    const IndexFinding *fa = (const IndexFinding *) a;
+    const IndexFinding *fb = (const IndexFinding *) b;
+
+    if ( fa->writes != fb->writes ) {
+        return fa->writes > fb->writes ? -1 : 1;
+    }
+    if ( fa->size != fb->size ) {
+        return fa->size > fb->size ? -1 : 1;
+    }
+    return 0;
+}
+
+/*
+ * pgsword_index_report - 没用的，重复的索引，按写入代价排序
+ *
+ *   observed_seconds 是实际覆盖的时间，刚启动时会小于
+ * pgsword.index_advisor_window，这时的 never scanned 只能作参考．
+ */
+Datum pgsword_index_report(PG_FUNCTION_ARGS) {
+    ReturnSetInfo   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    TupleDesc        tupdesc;
+    Tuplestorestate *tupstore;
+    MemoryContext    oldcontext;
+    IndexFinding    *findings;
+    int              nfindings = 0;
+    TimestampTz      now = GetCurrentTimestamp();
+    int              head;
+    int              i;
+
+    if ( advisorShared == NULL ) {
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                    errmsg("QunarSQLAudit: pgsword must be loaded via shared_preload_libraries")));
+    }
+
+    if ( rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo)
+        ||
+         !(rsinfo->allowedModes & SFRM_Materialize) ) {
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                    errmsg("set-valued function called in context that cannot accept a set")));
+    }
+
+    if ( get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE ) {
+        elog(ERROR, "return type must be a row type");
+    }
+
+    oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+    tupstore = tuplestore_begin_heap(true, false, work_mem);
+    rsinfo->returnMode = SFRM_Materialize;
+    rsinfo->setResult = tupstore;
+    rsinfo->setDesc = tupdesc;
+    MemoryContextSwitchTo(oldcontext);
+
+    LWLockAcquire(advisorShared->lock, LW_SHARED);
+
+    // 索引的 oid 只在采样的那个数据库里有意义
+    if ( OidIsValid(advisorShared->dboid) && advisorShared->dboid != MyDatabaseId ) {
+        LWLockRelease(advisorShared->lock);
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                    errmsg("QunarSQLAudit: index usage is sampled in another database"),
+                    errhint("connect to database \"%s\" (pgsword.index_advisor_database)",
+                            pgsword_index_advisor_database)));
+    }
+
+    findings = palloc(sizeof(IndexFinding) * Max(advisorShared->nentries, 1));
+    head = advisorShared->head;
+
+    for ( i = 0; i < advisorShared->nentries; i++ ) {
+        IndexUsage   *e = &advisorShared->entries[i];
+        IndexFinding *f = &findings[nfindings];
+        int           base = windowBase(e, now);
+
+        if ( base < 0 ) {
+            continue;
+        }
+
+        f->indexrelid = e->indexrelid;
+        f->relid = e->relid;
+        f->scans = e->scans[head] - e->scans[base];
+        f->writes = e->writes[head] - e->writes[base];
+        f->size = e->size;
+        f->observed = (double) (advisorShared->sampleTime[head] - advisorShared->sampleTime[base])
+                      / USECS_PER_SEC;
+        f->reason = NULL;
+        f->redundantTo = InvalidOid;
+
+        if ( OidIsValid(e->duplicateOf) ) {
+            f->reason = "duplicate";
+            f->redundantTo = e->duplicateOf;
+        }
+        else if ( OidIsValid(e->prefixOf) ) {
+            f->reason = "prefix";
+            f->redundantTo = e->prefixOf;
+        }
+        else if ( f->scans == 0 && !e->enforcing && base != head ) {
+            f->reason = "never scanned";
+        }
+
+        if ( f->reason != NULL ) {
+            nfindings++;
+        }
+    }
+
+    LWLockRelease(advisorShared->lock);
+
+    qsort(findings, nfindings, sizeof(IndexFinding), indexFindingCmp);
+
+    for ( i = 0; i < nfindings; i++ ) {
+        Datum values[INDEX_REPORT_COLS];
+        bool  nulls[INDEX_REPORT_COLS] = { false };
+
+        values[0] = ObjectIdGetDatum(findings[i].indexrelid);
+        values[1] = ObjectIdGetDatum(findings[i].relid);
+        values[2] = CStringGetTextDatum(findings[i].reason);
+        values[3] = ObjectIdGetDatum(findings[i].redundantTo);
+        nulls[3] = !OidIsValid(findings[i].redundantTo);
+        values[4] = Int64GetDatum(findings[i].scans);
+        values[5] = Int64GetDatum(findings[i].size);
+        values[6] = Int64GetDatum(findings[i].writes);
+        values[7] = Float8GetDatum(findings[i].observed);
+
+        tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+    }
+
+    pfree(findings);
+
+    return (Datum) 0;
+}
@@ -0,0 +1,16 @@
+#ifndef _Qunar_SQL_Audit_INDEXADVISOR_H
+#define _Qunar_SQL_Audit_INDEXADVISOR_H
+
+#include "postgres.h"
+#include "fmgr.h"
+
+Size  indexAdvisorShmemSize(void);
+void  indexAdvisorShmemInit(void);
+void  registerIndexAdvisorWorker(void);
+bool  indexAdvisorTableWrites(Oid relid, int64 *inserts, int64 *updates, int64 *deletes,
+                              double *observed);
+
+PGDLLEXPORT void pgsword_index_advisor_main(Datum main_arg);
+PGDLLEXPORT Datum pgsword_index_report(PG_FUNCTION_ARGS);
+
+#endif
@@ -0,0 +1,641 @@
+/* -------------------------------------------------------------------------
+ *
+ * maintenance.c
+ *
+ *   VACUUM FULL，CLUSTER，REINDEX 的维护窗口调度．
+ *
+ *   这几个命令都会重写整张表或整个索引，并一直持有 AccessExclusiveLock
+ * (REINDEX 是 ShareLock)，在高峰期对热表执行等于停写．
+ *   打开 pgsword.maintenance_threshold 后，超过阈值的关系上的这些命令
+ * 不再立即执行，而是写进持久化的队列表 pgsword_maintenance_queue，
+ * 用户的语句立刻返回．只有 pgsword.maintenance_database 里的命令才会
+ * 放进队列，其它数据库没有执行队列的后台进程．
+ *   后台进程 pgsword maintenance 只在 pgsword.maintenance_window 配置的
+ * 时间段内，一次一个地执行队列里的任务：
+ *     - 执行前重新解析关系名，和入队时的 oid 不一致 (被删除或者重建过)
+ *       的任务，或者提交的角色已经不是属主的任务直接失败；
+ *     - CLUSTER 和 REINDEX 以关系属主的身份在 SECURITY_RESTRICTED_OPERATION
+ *       下执行，索引表达式里的函数不会以 superuser 身份运行 (VACUUM FULL
+ *       自己会切换到属主)；
+ *     - 用 lock_timeout 限制等锁时间，等不到锁就留到下一次重试；
+ *     - 任务之间按关系大小和 pgsword.maintenance_io_rate 留出空闲时间．
+ *       单个任务执行期间不限速，这个间隔只是给其它负载留出喘息的时间．
+ *
+ * Copyright (c) 2017-2017, Qunar DBA Group
+ *
+ * IDENTIFICATION
+ *      contrib/pgsword/maintenance.c
+ *
+ * -------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include <signal.h>
+
+#include "access/htup_details.h"
+#include "access/xact.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_authid.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_type.h"
+#include "commands/dbcommands.h"
+#include "commands/vacuum.h"
+#include "executor/spi.h"
+#include "lib/stringinfo.h"
+#include "miscadmin.h"
+#include "nodes/parsenodes.h"
+#include "parser/parser.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/proc.h"
+#include "tcop/dest.h"
+#include "tcop/utility.h"
+#include "utils/acl.h"
+#include "utils/builtins.h"
+#include "utils/datetime.h"
+#include "utils/guc.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/snapmgr.h"
+#include "utils/syscache.h"
+#include "utils/timestamp.h"
+
+#include "pgsword.h"
+#include "advisor.h"
+#include "maintenance.h"
+#include "reclaim.h"
+
+/* 不在维护窗口内，或者队列为空时的轮询间隔 */
+#define MAINTENANCE_NAPTIME_MS   60000L
+
+/* 等锁超时的任务最多重试几次 */
+#define MAINTENANCE_MAX_ATTEMPTS 3
+
+static volatile sig_atomic_t got_sighup = false;
+static volatile sig_atomic_t got_sigterm = false;
+
+/* 后台进程自己执行的命令不能再被放回队列 */
+static bool inMaintenanceWorker = false;
+
+static const char *queueSchemaSql =
+    "SELECT pg_catalog.quote_ident(n.nspname)"
+    "  FROM pg_catalog.pg_extension e"
+    "  JOIN pg_catalog.pg_namespace n ON n.oid = e.extnamespace"
+    " WHERE e.extname = 'pgsword'";
+
+/* 返回队列表的完整名字，扩展没有安装时返回 NULL．调用方已经 SPI_connect */
+static char *queueTableName(void) {
+    if ( SPI_execute(queueSchemaSql, true, 1) != SPI_OK_SELECT ) {
+        elog(ERROR, "pgsword: SPI_execute failed: %s", queueSchemaSql);
+    }
+    if ( SPI_processed != 1 ) {
+        return NULL;
+    }
+
+    return psprintf("%s.pgsword_maintenance_queue",
+                    SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1));
+}
+
+/*
+ * 从语句里取出要处理的关系，并生成放进队列的命令．
+ * 不是我们关心的形式 (VACUUM 不带 FULL，整库的 REINDEX 等) 返回 InvalidOid．
+ */
+static Oid maintenanceTarget(Node *parsetree, StringInfo cmd) {
+    RangeVar *rv = NULL;
+    Oid       relid;
+
+    switch ( nodeTag(parsetree) ) {
+        case T_VacuumStmt: {
+            VacuumStmt *stmt = (VacuumStmt *) parsetree;
+
+            if ( !(stmt->options & VACOPT_FULL) || stmt->relation == NULL ) {
+                return InvalidOid;
+            }
+            rv = stmt->relation;
+            appendStringInfo(cmd, "VACUUM (FULL%s%s) ",
+                             (stmt->options & VACOPT_VERBOSE) ? ", VERBOSE" : "",
+                             (stmt->options & VACOPT_ANALYZE) ? ", ANALYZE" : "");
+            break;
+        }
+
+        case T_ClusterStmt: {
+            ClusterStmt *stmt = (ClusterStmt *) parsetree;
+
+            if ( stmt->relation == NULL ) {
+                return InvalidOid;
+            }
+            rv = stmt->relation;
+            appendStringInfo(cmd, "CLUSTER %s", stmt->verbose ? "VERBOSE " : "");
+            break;
+        }
+
+        case T_ReindexStmt: {
+            ReindexStmt *stmt = (ReindexStmt *) parsetree;
+
+            if ( stmt->relation == NULL
+                ||
+                 (stmt->kind != REINDEX_OBJECT_TABLE && stmt->kind != REINDEX_OBJECT_INDEX) ) {
+                return InvalidOid;
+            }
+            rv = stmt->relation;
+            appendStringInfo(cmd, "REINDEX %s%s ",
+                             (stmt->options & REINDEXOPT_VERBOSE) ? "(VERBOSE) " : "",
+                             stmt->kind == REINDEX_OBJECT_TABLE ? "TABLE" : "INDEX");
+            break;
+        }
+
+        default:
+            return InvalidOid;
+    }
+
+    relid = RangeVarGetRelid(rv, NoLock, true);
+    if ( !OidIsValid(relid) ) {
+        return InvalidOid;
+    }
+
+    appendStringInfoString(cmd,
+                           quote_qualified_identifier(get_namespace_name(get_rel_namespace(relid)),
+                                                      get_rel_name(relid)));
+
+    if ( IsA(parsetree, ClusterStmt) && ((ClusterStmt *) parsetree)->indexname ) {
+        appendStringInfo(cmd, " USING %s",
+                         quote_identifier(((ClusterStmt *) parsetree)->indexname));
+    }
+
+    return relid;
+}
+
+/*
+ * queueMaintenance - 大关系上的 VACUUM FULL / CLUSTER / REINDEX 放进队列
+ *
+ *   只有关系的属主的命令才放进队列，后台进程是以 superuser 执行的．
+ *   返回 true 表示已经放进队列，不需要再执行．
+ */
+bool queueMaintenance(PlannedStmt *pstmt) {
+    Node           *parsetree = pstmt->utilityStmt;
+    StringInfoData  cmd;
+    Oid             relid;
+    int64           bytes;
+    char           *queue;
+    Oid             save_userid;
+    int             save_sec_context;
+    Oid             argtypes[5] = { OIDOID, TEXTOID, INT8OID, TEXTOID, OIDOID };
+    Datum           values[5];
+    int64           jobid;
+    bool            isnull;
+
+    if ( pgsword_maintenance_threshold < 0 || inMaintenanceWorker ) {
+        return false;
+    }
+
+    // 只有后台进程所在的数据库才有人执行队列
+    if ( pgsword_maintenance_database == NULL || pgsword_maintenance_database[0] == '\0'
+        ||
+         strcmp(get_database_name(MyDatabaseId), pgsword_maintenance_database) != 0 ) {
+        return false;
+    }
+
+    initStringInfo(&cmd);
+    relid = maintenanceTarget(parsetree, &cmd);
+    if ( !OidIsValid(relid) || !pg_class_ownercheck(relid, GetUserId()) ) {
+        return false;
+    }
+
+    bytes = relationTotalBytes(relid);
+    if ( bytes < (int64) pgsword_maintenance_threshold * 1024 * 1024 ) {
+        return false;
+    }
+
+    if ( SPI_connect() != SPI_OK_CONNECT ) {
+        elog(ERROR, "pgsword: SPI_connect failed");
+    }
+
+    queue = queueTableName();
+    if ( queue == NULL ) {
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                    errmsg("QunarSQLAudit: pgsword.maintenance_threshold is set "
+                           "but extension pgsword is not installed in this database")));
+    }
+
+    values[0] = ObjectIdGetDatum(relid);
+    values[1] = CStringGetTextDatum(cmd.data);
+    values[2] = Int64GetDatum(bytes);
+    values[3] = CStringGetTextDatum(GetUserNameFromId(GetUserId(), false));
+    values[4] = ObjectIdGetDatum(GetUserId());
+
+    // 队列表只对 superuser 开放写入
+    GetUserIdAndSecContext(&save_userid, &save_sec_context);
+    SetUserIdAndSecContext(BOOTSTRAP_SUPERUSERID,
+                           save_sec_context | SECURITY_LOCAL_USERID_CHANGE);
+
+    if ( SPI_execute_with_args(psprintf("INSERT INTO %s (relid, command, rel_bytes, submitted_by, submitter)"
+                                        " VALUES ($1, $2, $3, $4, $5) RETURNING id", queue),
+                               5, argtypes, values, NULL, false, 1) != SPI_OK_INSERT_RETURNING ) {
+        elog(ERROR, "pgsword: failed to queue maintenance command");
+    }
+    jobid = DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull));
+
+    SetUserIdAndSecContext(save_userid, save_sec_context);
+
+    SPI_finish();
+
+    ereport(NOTICE,
+            (errcode(ERRCODE_SUCCESSFUL_COMPLETION),
+                errmsg("QunarSQLAudit: \"%s\" (%s) is queued as maintenance job " INT64_FORMAT
+                       ", it will run in the maintenance window \"%s\"",
+                       cmd.data, prettySize(bytes), jobid, pgsword_maintenance_window),
+                errhint("see table %s", queue)));
+
+    pfree(cmd.data);
+
+    return true;
+}
+
+/* ---------------------------------------------------------------------- */
+/* 后台执行进程                                                             */
+/* ---------------------------------------------------------------------- */
+
+/*
+ * 当前时间是否在维护窗口内．
+ *   格式 "HH:MM-HH:MM[, HH:MM-HH:MM ...]"，按服务器时区，可以跨零点．
+ */
+static bool inMaintenanceWindow(void) {
+    struct pg_tm tm;
+    fsec_t       fsec;
+    int          tz;
+    int          now;
+    char        *rawstring;
+    char        *item;
+    char        *saveptr = NULL;
+    bool         inside = false;
+
+    if ( pgsword_maintenance_window == NULL || pgsword_maintenance_window[0] == '\0' ) {
+        return false;
+    }
+
+    if ( timestamp2tm(GetCurrentTimestamp(), &tz, &tm, &fsec, NULL, NULL) != 0 ) {
+        return false;
+    }
+    now = tm.tm_hour * 60 + tm.tm_min;
+
+    rawstring = pstrdup(pgsword_maintenance_window);
+
+    for ( item = strtok_r(rawstring, ",", &saveptr);
+          item != NULL && !inside;
+          item = strtok_r(NULL, ",", &saveptr) ) {
+        int h1, m1, h2, m2;
+        int start, end;
+
+        if ( sscanf(item, " %d:%d - %d:%d", &h1, &m1, &h2, &m2) != 4 ) {
+            ereport(WARNING,
+                    (errmsg("pgsword: invalid maintenance window \"%s\"", item)));
+            continue;
+        }
+
+        start = h1 * 60 + m1;
+        end = h2 * 60 + m2;
+
+        if ( start <= end ) {
+            inside = now >= start && now < end;
+        }
+        else {
+            inside = now >= start || now < end;
+        }
+    }
+
+    pfree(rawstring);
+
+    return inside;
+}
+
+/* 在自己的事务里执行一条 SQL，返回第一行第一列 (可能为 NULL)，结果在调用方的上下文里 */
+static char *spiRun(const char *sql, int nargs, Oid *argtypes, Datum *values, bool readonly) {
+    MemoryContext callercxt = CurrentMemoryContext;
+    char         *result = NULL;
+    int           ret;
+
+    SetCurrentStatementStartTimestamp();
+    StartTransactionCommand();
+    SPI_connect();
+    PushActiveSnapshot(GetTransactionSnapshot());
+
+    ret = SPI_execute_with_args(sql, nargs, argtypes, values, NULL, readonly, 0);
+    if ( ret < 0 ) {
+        elog(ERROR, "pgsword: SPI_execute_with_args failed: %s", sql);
+    }
+
+    if ( SPI_tuptable != NULL && SPI_processed > 0 ) {
+        char *v = SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1);
+
+        if ( v != NULL ) {
+            result = MemoryContextStrdup(callercxt, v);
+        }
+    }
+
+    SPI_finish();
+    PopActiveSnapshot();
+    CommitTransactionCommand();
+    MemoryContextSwitchTo(callercxt);
+
+    return result;
+}
+
+/* 关系当前的属主 */
+static Oid relationOwner(Oid relid) {
+    HeapTuple tuple;
+    Oid       owner;
+
+    tuple = SearchSysCache1(RELOID, ObjectIdGetDatum(relid));
+    if ( !HeapTupleIsValid(tuple) ) {
+        elog(ERROR, "pgsword: cache lookup failed for relation %u", relid);
+    }
+    owner = ((Form_pg_class) GETSTRUCT(tuple))->relowner;
+    ReleaseSysCache(tuple);
+
+    return owner;
+}
+
+/*
+ * 像 exec_simple_query 一样执行一条维护命令，relid 是入队时的关系，
+ * submitter 是提交任务的角色．
+ */
+static void runUtility(const char *command, Oid relid, Oid submitter) {
+    MemoryContext  callercxt = CurrentMemoryContext;
+    List          *raw;
+    RawStmt       *rawstmt;
+    PlannedStmt   *pstmt;
+    StringInfoData target;
+    Oid            save_userid;
+    int            save_sec_context;
+    bool           switchUser;
+
+    SetCurrentStatementStartTimestamp();
+    StartTransactionCommand();
+    pgstat_report_activity(STATE_RUNNING, command);
+
+    raw = raw_parser(command);
+    if ( list_length(raw) != 1 ) {
+        elog(ERROR, "pgsword: unexpected maintenance command: %s", command);
+    }
+    rawstmt = (RawStmt *) linitial(raw);
+
+    // 入队以后关系可能被删除，或者同名的关系被重建过
+    initStringInfo(&target);
+    if ( maintenanceTarget(rawstmt->stmt, &target) != relid ) {
+        ereport(ERROR,
+                (errcode(ERRCODE_UNDEFINED_TABLE),
+                    errmsg("pgsword: relation of maintenance command \"%s\" "
+                           "was dropped or replaced since it was queued", command)));
+    }
+
+    // 入队以后属主可能变了
+    if ( !pg_class_ownercheck(relid, submitter) ) {
+        ereport(ERROR,
+                (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+                    errmsg("pgsword: role %u no longer owns the relation of maintenance command \"%s\"",
+                           submitter, command)));
+    }
+
+    pstmt = makeNode(PlannedStmt);
+    pstmt->commandType = CMD_UTILITY;
+    pstmt->canSetTag = true;
+    pstmt->utilityStmt = rawstmt->stmt;
+    pstmt->stmt_location = rawstmt->stmt_location;
+    pstmt->stmt_len = rawstmt->stmt_len;
+
+    PushActiveSnapshot(GetTransactionSnapshot());
+
+    // VACUUM 会自己提交事务，并且自己切换到属主；
+    // CLUSTER 和 REINDEX 要在这里以属主身份执行，出错时事务回滚会恢复身份
+    switchUser = !IsA(rawstmt->stmt, VacuumStmt);
+    if ( switchUser ) {
+        GetUserIdAndSecContext(&save_userid, &save_sec_context);
+        SetUserIdAndSecContext(relationOwner(relid),
+                               save_sec_context | SECURITY_LOCAL_USERID_CHANGE
+                               | SECURITY_RESTRICTED_OPERATION);
+    }
+
+    ProcessUtility(pstmt, command, PROCESS_UTILITY_TOPLEVEL,
+                   NULL, NULL, None_Receiver, NULL);
+
+    if ( switchUser ) {
+        SetUserIdAndSecContext(save_userid, save_sec_context);
+    }
+
+    // VACUUM 会自己管理事务和快照
+    if ( ActiveSnapshotSet() ) {
+        PopActiveSnapshot();
+    }
+    CommitTransactionCommand();
+    MemoryContextSwitchTo(callercxt);
+
+    pgstat_report_activity(STATE_IDLE, NULL);
+}
+
+/*
+ * runNextJob - 执行队列里最早的一个任务
+ *
+ *   返回执行的关系大小 (用于计算下一个任务前的间隔)，没有任务返回 -1．
+ */
+static int64 runNextJob(const char *queue) {
+    Oid            argtypes[2] = { INT8OID, TEXTOID };
+    Datum          values[2];
+    char          *job;
+    int64          jobid;
+    Oid            relid;
+    Oid            submitter;
+    char          *command;
+    int64          bytes;
+    MemoryContext  oldcxt = CurrentMemoryContext;
+    ErrorData     *edata = NULL;
+
+    // 取任务并标记为 running，一个事务内完成
+    job = spiRun(psprintf("UPDATE %s SET status = 'running', started_at = pg_catalog.now(),"
+                          "       attempts = attempts + 1"
+                          " WHERE id = (SELECT id FROM %s WHERE status = 'queued'"
+                          "              ORDER BY id LIMIT 1 FOR UPDATE SKIP LOCKED)"
+                          " RETURNING id || ' ' || rel_bytes || ' ' || relid || ' ' || submitter"
+                          "           || ' ' || command",
+                          queue, queue),
+                 0, NULL, NULL, false);
+    if ( job == NULL ) {
+        return -1;
+    }
+
+    if ( sscanf(job, INT64_FORMAT " " INT64_FORMAT " %u %u",
+                &jobid, &bytes, &relid, &submitter) != 4 ) {
+        elog(ERROR, "pgsword: malformed maintenance job \"%s\"", job);
+    }
+    command = strchr(strchr(strchr(strchr(job, ' ') + 1, ' ') + 1, ' ') + 1, ' ') + 1;
+
+    ereport(LOG,
+            (errmsg("pgsword: running maintenance job " INT64_FORMAT ": %s", jobid, command)));
+
+    SetConfigOption("lock_timeout", psprintf("%d", pgsword_maintenance_lock_timeout),
+                    PGC_SUSET, PGC_S_SESSION);
+
+    PG_TRY();
+    {
+        runUtility(command, relid, submitter);
+    }
+    PG_CATCH();
+    {
+        MemoryContextSwitchTo(oldcxt);
+        edata = CopyErrorData();
+        FlushErrorState();
+        AbortCurrentTransaction();
+        if ( ActiveSnapshotSet() ) {
+            PopActiveSnapshot();
+        }
+        MemoryContextSwitchTo(oldcxt);
+        pgstat_report_activity(STATE_IDLE, NULL);
+    }
+    PG_END_TRY();
+
+    values[0] = Int64GetDatum(jobid);
+
+    if ( edata == NULL ) {
+        spiRun(psprintf("UPDATE %s SET status = 'done', finished_at = pg_catalog.now(),"
+                        "       last_error = NULL WHERE id = $1", queue),
+               1, argtypes, values, false);
+    }
+    else {
+        // 等锁超时的任务留到下次重试，其它错误直接失败
+        bool retry = edata->sqlerrcode == ERRCODE_LOCK_NOT_AVAILABLE;
+
+        values[1] = CStringGetTextDatum(edata->message);
+        spiRun(psprintf("UPDATE %s SET finished_at = pg_catalog.now(), last_error = $2,"
+                        "       status = CASE WHEN %s AND attempts < %d"
+                        "                     THEN 'queued' ELSE 'failed' END"
+                        " WHERE id = $1",
+                        queue, retry ? "true" : "false", MAINTENANCE_MAX_ATTEMPTS),
+               2, argtypes, values, false);
+
+        ereport(LOG,
+                (errmsg("pgsword: maintenance job " INT64_FORMAT " failed: %s",
+                        jobid, edata->message)));
+        FreeErrorData(edata);
+    }
+
+    pfree(job);
+
+    return bytes;
+}
+
+static void maintenance_sighup(SIGNAL_ARGS) {
+    int save_errno = errno;
+
+    got_sighup = true;
+    SetLatch(MyLatch);
+
+    errno = save_errno;
+}
+
+static void maintenance_sigterm(SIGNAL_ARGS) {
+    int save_errno = errno;
+
+    got_sigterm = true;
+    SetLatch(MyLatch);
+
+    errno = save_errno;
+}
+
+void registerMaintenanceWorker(void) {
+    BackgroundWorker worker;
+
+    memset(&worker, 0, sizeof(worker));
+    worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+    worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+    worker.bgw_restart_time = 60;
+    snprintf(worker.bgw_name, BGW_MAXLEN, "pgsword maintenance");
+    snprintf(worker.bgw_library_name, BGW_MAXLEN, "pgsword");
+    snprintf(worker.bgw_function_name, BGW_MAXLEN, "pgsword_maintenance_main");
+    worker.bgw_main_arg = (Datum) 0;
+    worker.bgw_notify_pid = 0;
+
+    RegisterBackgroundWorker(&worker);
+}
+
+void pgsword_maintenance_main(Datum main_arg) {
+    MemoryContext loopContext;
+    char         *queue;
+
+    pqsignal(SIGHUP, maintenance_sighup);
+    pqsignal(SIGTERM, maintenance_sigterm);
+
+    BackgroundWorkerUnblockSignals();
+
+    BackgroundWorkerInitializeConnection(pgsword_maintenance_database, NULL);
+
+    inMaintenanceWorker = true;
+
+    // 后台进程的命令不能被审核模式拦下
+    SetConfigOption("pgsword.enabled", "off", PGC_SUSET, PGC_S_OVERRIDE);
+
+    // 上次进程退出时正在执行的任务重新排队
+    queue = spiRun(queueSchemaSql, 0, NULL, NULL, true);
+    if ( queue != NULL ) {
+        spiRun(psprintf("UPDATE %s.pgsword_maintenance_queue SET status = 'queued'"
+                        " WHERE status = 'running'", queue),
+               0, NULL, NULL, false);
+    }
+
+    // 每一轮的查询语句和结果都分配在这里，每轮开始时清空
+    loopContext = AllocSetContextCreate(TopMemoryContext,
+                                        "pgsword maintenance loop",
+                                        ALLOCSET_DEFAULT_SIZES);
+
+    while ( !got_sigterm ) {
+        int    rc;
+        long   delay = MAINTENANCE_NAPTIME_MS;
+
+        MemoryContextReset(loopContext);
+        MemoryContextSwitchTo(loopContext);
+
+        if ( inMaintenanceWindow() ) {
+            queue = spiRun(queueSchemaSql, 0, NULL, NULL, true);
+
+            if ( queue != NULL ) {
+                TimestampTz start = GetCurrentTimestamp();
+                int64       bytes;
+
+                queue = psprintf("%s.pgsword_maintenance_queue", queue);
+                bytes = runNextJob(queue);
+
+                if ( bytes >= 0 ) {
+                    long   secs;
+                    int    usecs;
+                    double target;
+
+                    // 按 pgsword.maintenance_io_rate 计算这个任务应该占用的时间，
+                    // 提前完成的部分就空闲等着，再执行下一个任务
+                    TimestampDifference(start, GetCurrentTimestamp(), &secs, &usecs);
+                    target = (double) bytes / ((double) pgsword_maintenance_io_rate * 1024 * 1024);
+                    delay = (long) Max(0.0, (target - secs - usecs / 1e6) * 1000.0) + 1;
+                }
+            }
+        }
+
+        rc = WaitLatch(MyLatch,
+                       WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+                       delay,
+                       PG_WAIT_EXTENSION);
+        ResetLatch(MyLatch);
+
+        if ( rc & WL_POSTMASTER_DEATH ) {
+            proc_exit(1);
+        }
+
+        CHECK_FOR_INTERRUPTS();
+
+        if ( got_sighup ) {
+            got_sighup = false;
+            ProcessConfigFile(PGC_SIGHUP);
+        }
+    }
+
+    proc_exit(0);
+}
@@ -0,0 +1,12 @@
+#ifndef _Qunar_SQL_Audit_MAINTENANCE_H
+#define _Qunar_SQL_Audit_MAINTENANCE_H
+
+#include "postgres.h"
+#include "nodes/plannodes.h"
+
+bool  queueMaintenance(PlannedStmt *pstmt);
+void  registerMaintenanceWorker(void);
+
+PGDLLEXPORT void pgsword_maintenance_main(Datum main_arg);
+
+#endif
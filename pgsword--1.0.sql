@@ -3,3 +3,75 @@
 -- complain if script is sourced in psql, rather than via CREATE EXTENSION
 \echo Use "CREATE EXTENSION pgsword" to load this file. \quit
 
+
+-- 没用的，重复的索引，按写入代价排序
+-- 需要 shared_preload_libraries = 'pgsword' 并设置 pgsword.index_advisor_database
+CREATE FUNCTION pgsword_index_report(
+    OUT indexrelid regclass,
+    OUT relid regclass,
+    OUT reason text,
+    OUT redundant_to regclass,
+    OUT idx_scan bigint,
+    OUT index_bytes bigint,
+    OUT index_writes bigint,
+    OUT observed_seconds float8
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pgsword_index_report'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE VIEW pgsword_index_report AS
+    SELECT * FROM pgsword_index_report();
+
+-- VACUUM FULL，CLUSTER，REINDEX 的维护队列
+-- 设置 pgsword.maintenance_threshold 后，大关系上的这些命令写进这里，
+-- 由 pgsword.maintenance_database 里的后台进程在 pgsword.maintenance_window 内执行
+CREATE TABLE pgsword_maintenance_queue (
+    id           bigserial PRIMARY KEY,
+    relid        oid NOT NULL,
+    command      text NOT NULL,
+    rel_bytes    bigint NOT NULL,
+    submitted_by name NOT NULL,
+    submitter    oid NOT NULL,      -- 提交的角色，执行前检查它仍然是属主
+    submitted_at timestamptz NOT NULL DEFAULT now(),
+    status       text NOT NULL DEFAULT 'queued'
+                 CHECK (status IN ('queued', 'running', 'done', 'failed')),
+    attempts     int NOT NULL DEFAULT 0,
+    started_at   timestamptz,
+    finished_at  timestamptz,
+    last_error   text
+);
+
+REVOKE ALL ON pgsword_maintenance_queue FROM PUBLIC;
+GRANT SELECT ON pgsword_maintenance_queue TO PUBLIC;
+
+SELECT pg_catalog.pg_extension_config_dump('pgsword_maintenance_queue', '');
+SELECT pg_catalog.pg_extension_config_dump('pgsword_maintenance_queue_id_seq', '');
+
+-- 审核整个脚本，不执行，按语句顺序返回审核结果
+-- 语句足够多时用 pgsword.audit_workers 个后台进程并行审核
+CREATE FUNCTION pgsword_audit_script(
+    script text,
+    OUT stmt_no int,
+    OUT severity text,
+    OUT message text,
+    OUT detail text,
+    OUT hint text
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pgsword_audit_script'
+LANGUAGE C STRICT VOLATILE;
+
+-- 审核时会绕过权限设置 pgsword.enabled 和 log_min_messages，默认只给 superuser 用
+REVOKE ALL ON FUNCTION pgsword_audit_script(text) FROM PUBLIC;
+
+-- 本后端的审核统计，包括单条语句审核用到的最大内存
+CREATE FUNCTION pgsword_audit_stats(
+    OUT statements bigint,
+    OUT peak_memory bigint,
+    OUT last_memory bigint,
+    OUT memory_limit_hits bigint
+)
+RETURNS record
+AS 'MODULE_PATHNAME', 'pgsword_audit_stats'
+LANGUAGE C STRICT VOLATILE;
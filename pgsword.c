@@ -17,27 +17,138 @@
 #include "parser/parse_node.h"
 #include "parser/parse_utilcmd.h"
 #include "parser/analyze.h"
+#include "parser/parsetree.h"
 #include "nodes/pg_list.h"
 #include "nodes/parsenodes.h"
+#include "nodes/nodeFuncs.h"
+#include "nodes/execnodes.h"
+#include "optimizer/planner.h"
+#include "executor/executor.h"
+#include "executor/tuptable.h"
 #include "tcop/utility.h"
 #include "utils/guc.h"
 #include "utils/elog.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
 #include "utils/syscache.h"
-
+#include "miscadmin.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+
+#include "pgsword.h"
+#include "advisor.h"
+#include "auditmem.h"
+#include "batchaudit.h"
+#include "indexadvisor.h"
+#include "maintenance.h"
+#include "reclaim.h"
 #include "rule.h"
+#include "sarg.h"
 #include "tools.h"
+#include "volatility.h"
 
 PG_MODULE_MAGIC;
 
 static bool pgsword_enabled = false;
+int   pgsword_max_rows_modified = -1;
+char *pgsword_table_max_rows_modified = NULL;
+int   pgsword_deferred_drop_threshold = -1;
+char *pgsword_quarantine_schema = NULL;
+int   pgsword_reclaim_rate = 64;
+char *pgsword_reclaim_database = NULL;
+int   pgsword_index_concurrently_threshold = 1024;
+int   pgsword_alignment_waste_threshold = 8;
+char *pgsword_update_heavy_tables = NULL;
+bool  pgsword_reject_unindexed_fk = false;
+bool  pgsword_enforce_function_volatility = false;
+int   pgsword_row_trigger_max_write_rate = 1000;
+bool  pgsword_reject_row_trigger = false;
+char *pgsword_index_advisor_database = NULL;
+int   pgsword_ctas_max_size = -1;
+char *pgsword_ctas_tablespace = NULL;
+int   pgsword_index_advisor_window = 7 * 24 * 3600;
+int   pgsword_index_advisor_max_indexes = 2000;
+int   pgsword_maintenance_threshold = -1;
+char *pgsword_maintenance_window = NULL;
+char *pgsword_maintenance_database = NULL;
+int   pgsword_maintenance_io_rate = 64;
+int   pgsword_maintenance_lock_timeout = 10000;
+int   pgsword_audit_workers = 4;
+int   pgsword_audit_memory_limit = 65536;
 static post_parse_analyze_hook_type prev_post_parse_analyze_hook = NULL;
+static planner_hook_type            prev_planner_hook = NULL;
 //static ExecutorStart_hook_type  prev_ExecutorStart_hook = NULL;
+static ExecutorRun_hook_type    prev_ExecutorRun_hook = NULL;
+static ExecutorFinish_hook_type prev_ExecutorFinish_hook = NULL;
 static ProcessUtility_hook_type prev_ProcessUtility_hook = NULL;
+static shmem_startup_hook_type  prev_shmem_startup_hook = NULL;
+
+/*
+ * RowGuardPlan - 一个 ModifyTable 子计划的行数计数器
+ *
+ *   ModifyTable 每从子计划取出一行，就修改一行，所以我们把子计划的
+ * ExecProcNodeReal 换成 rowGuardExecProcNode，在这里计数．
+ *   没超限时每行的开销只有一次指针比较和两次加法．
+ */
+typedef struct RowGuard RowGuard;
+
+typedef struct RowGuardPlan {
+    PlanState         *subplan;
+    ExecProcNodeMtd    realProcNode;
+    RowGuard          *guard;
+    const char        *relname;    /* 被修改的表 (分区/子表) */
+    int64              limit;      /* -1 表示不限 */
+    int64              nrows;
+    struct RowGuardPlan *next;     /* 全局链表 */
+} RowGuardPlan;
+
+/* 一个 ModifyTable 节点的总计数，对应 nominal relation (父表) */
+struct RowGuard {
+    CmdType            operation;
+    const char        *relname;
+    int64              limit;
+    int64              nrows;
+};
+
+/*
+ * 当前所有正在执行的被保护子计划．
+ * 嵌套执行器 (触发器，函数) 会往表头插入，
+ * es_query_cxt 销毁时 (正常结束或出错) 由 rowGuardReset 摘除．
+ */
+static RowGuardPlan *rowGuardPlans = NULL;
+static RowGuardPlan *rowGuardLast = NULL;
 
 void _PG_init(void);
 void _PG_fini(void);
+static void my_shmem_startup(void);
 static void my_post_parse_analyze(ParseState *pstate, Query *query);
+static PlannedStmt *my_planner(Query *parse, int cursorOptions, ParamListInfo boundParams);
 //static void my_ExecutorStart(QueryDesc *queryDesc, int eflags);
+static void my_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction,
+                           uint64 count, bool execute_once);
+static void my_ExecutorFinish(QueryDesc *queryDesc);
+static void rowGuardInstall(QueryDesc *queryDesc);
+static bool rowGuardWalker(PlanState *planstate, void *context);
+static TupleTableSlot *rowGuardExecProcNode(PlanState *pstate);
+static void rowGuardReset(void *arg);
+static bool check_table_max_rows_modified(char **newval, void **extra, GucSource source);
+/* CTAS 的查询在 checkCreateTableAs() 里已经规划过，直接用那个计划 */
+static PlannedStmt *my_planner(Query *parse, int cursorOptions, ParamListInfo boundParams)
+{
+    PlannedStmt *plan = takeCtasPlan(parse, cursorOptions, boundParams);
+
+    if ( plan != NULL ) {
+        return plan;
+    }
+
+    if (prev_planner_hook) {
+        return prev_planner_hook(parse, cursorOptions, boundParams);
+    }
+    return standard_planner(parse, cursorOptions, boundParams);
+}
+
 static void my_process_utility(PlannedStmt *pstmt,
                                const char *queryString, ProcessUtilityContext context,
                                ParamListInfo params,
@@ -64,12 +175,265 @@ NOT_ENABLED:
     }
 }*/
 
+/*
+ * UPDATE/DELETE 行数熔断
+ *
+ *   执行计划的行数估计并不可靠，一条预期只改几行的 UPDATE/DELETE
+ * 实际改了几百万行，会写满 WAL，让表膨胀．
+ *   这里在 ExecutorRun 时给每个 UPDATE/DELETE 的 ModifyTable 子计划
+ * 装上计数器，一旦超过限制 (pgsword.max_rows_modified，可以用
+ * ALTER ROLE ... SET 按角色设置；pgsword.table_max_rows_modified 按表
+ * 设置) 立刻报错，整个事务回滚．
+ */
+static bool rowGuardActive(void)
+{
+    return pgsword_max_rows_modified >= 0
+           ||
+           (pgsword_table_max_rows_modified != NULL &&
+            pgsword_table_max_rows_modified[0] != '\0');
+}
+
+/* 取两个限制中较严格的一个，-1 表示不限 */
+static int64 rowGuardMinLimit(int64 a, int64 b)
+{
+    if ( a < 0 )
+        return b;
+    if ( b < 0 )
+        return a;
+    return a < b ? a : b;
+}
+
+static void rowGuardInstall(QueryDesc *queryDesc)
+{
+    EState   *estate = queryDesc->estate;
+    ListCell *l;
+
+    if ( queryDesc->operation != CMD_UPDATE && queryDesc->operation != CMD_DELETE
+        &&
+         !queryDesc->plannedstmt->hasModifyingCTE ) {
+        return;
+    }
+
+    rowGuardWalker(queryDesc->planstate, estate);
+
+    /* WITH 子句中的 UPDATE/DELETE 不在主计划树里 */
+    foreach(l, estate->es_subplanstates) {
+        rowGuardWalker((PlanState *) lfirst(l), estate);
+    }
+}
+
+static bool rowGuardWalker(PlanState *planstate, void *context)
+{
+    EState               *estate = (EState *) context;
+    ModifyTableState     *mtstate;
+    ModifyTable          *mt;
+    RowGuard             *guard;
+    MemoryContext         oldcxt;
+    MemoryContextCallback *cb;
+    Oid                   nominalOid;
+    int                   i;
+
+    if ( planstate == NULL )
+        return false;
+
+    if ( !IsA(planstate, ModifyTableState) )
+        return planstate_tree_walker(planstate, rowGuardWalker, context);
+
+    mtstate = (ModifyTableState *) planstate;
+    mt = (ModifyTable *) planstate->plan;
+
+    if ( mtstate->operation != CMD_UPDATE && mtstate->operation != CMD_DELETE )
+        return planstate_tree_walker(planstate, rowGuardWalker, context);
+
+    // 同一个节点可能经由 SubPlan 和 es_subplanstates 被访问两次
+    if ( mtstate->mt_nplans > 0
+        &&
+         mtstate->mt_plans[0]->ExecProcNodeReal == rowGuardExecProcNode )
+        return false;
+
+    oldcxt = MemoryContextSwitchTo(estate->es_query_cxt);
+
+    guard = palloc0(sizeof(RowGuard));
+    guard->operation = mtstate->operation;
+    nominalOid = getrelid(mt->nominalRelation, estate->es_range_table);
+    guard->relname = get_rel_name(nominalOid);
+    guard->limit = rowGuardMinLimit(
+                        pgsword_max_rows_modified,
+                        lookupTableRowLimit(pgsword_table_max_rows_modified,
+                                            get_namespace_name(get_rel_namespace(nominalOid)),
+                                            guard->relname));
+
+    for ( i = 0; i < mtstate->mt_nplans; i++ ) {
+        Relation      rel = mtstate->resultRelInfo[i].ri_RelationDesc;
+        RowGuardPlan *gp = palloc0(sizeof(RowGuardPlan));
+
+        gp->subplan = mtstate->mt_plans[i];
+        gp->realProcNode = gp->subplan->ExecProcNodeReal;
+        gp->guard = guard;
+        gp->relname = RelationGetRelationName(rel);
+        gp->limit = lookupTableRowLimit(pgsword_table_max_rows_modified,
+                                        get_namespace_name(RelationGetNamespace(rel)),
+                                        gp->relname);
+
+        // 只换 ExecProcNodeReal，ExecProcNodeFirst 和 EXPLAIN ANALYZE
+        // 的 ExecProcNodeInstr 都会经由它调用到我们
+        gp->subplan->ExecProcNodeReal = rowGuardExecProcNode;
+
+        gp->next = rowGuardPlans;
+        rowGuardPlans = gp;
+    }
+
+    cb = palloc0(sizeof(MemoryContextCallback));
+    cb->func = rowGuardReset;
+    cb->arg = estate;
+    MemoryContextRegisterResetCallback(estate->es_query_cxt, cb);
+
+    MemoryContextSwitchTo(oldcxt);
+
+    return planstate_tree_walker(planstate, rowGuardWalker, context);
+}
+
+static void rowGuardAbort(RowGuardPlan *gp)
+{
+    const char *op = gp->guard->operation == CMD_UPDATE ? "UPDATE" : "DELETE";
+
+    if ( gp->limit >= 0 && gp->nrows > gp->limit ) {
+        ereport(ERROR,
+                (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+                    errmsg("QunarSQLAudit: %s on table \"%s\" exceeds the limit of "
+                           INT64_FORMAT " rows",
+                           op, gp->relname, gp->limit),
+                    errhint("see pgsword.table_max_rows_modified")));
+    }
+
+    ereport(ERROR,
+            (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+                errmsg("QunarSQLAudit: %s on table \"%s\" exceeds the limit of "
+                       INT64_FORMAT " rows",
+                       op,
+                       gp->guard->relname ? gp->guard->relname : gp->relname,
+                       gp->guard->limit),
+                errhint("split the statement into smaller batches, "
+                        "or ask a DBA to raise pgsword.max_rows_modified")));
+}
+
+static TupleTableSlot *rowGuardExecProcNode(PlanState *pstate)
+{
+    RowGuardPlan   *gp = rowGuardLast;
+    TupleTableSlot *slot;
+
+    if ( gp == NULL || gp->subplan != pstate ) {
+        for ( gp = rowGuardPlans; gp != NULL; gp = gp->next ) {
+            if ( gp->subplan == pstate )
+                break;
+        }
+        // 不可能走到这里，除非计数器已经被摘除后节点又被执行
+        if ( gp == NULL )
+            elog(ERROR, "pgsword: lost row guard for plan node");
+        rowGuardLast = gp;
+    }
+
+    slot = gp->realProcNode(pstate);
+
+    if ( !TupIsNull(slot) ) {
+        gp->nrows++;
+        gp->guard->nrows++;
+
+        if ( (gp->limit >= 0 && gp->nrows > gp->limit)
+            ||
+             (gp->guard->limit >= 0 && gp->guard->nrows > gp->guard->limit) ) {
+            rowGuardAbort(gp);
+        }
+    }
+
+    return slot;
+}
+
+/* pgsword.table_max_rows_modified 的格式在 SET 时检查，不合法的条目不会被悄悄忽略 */
+static bool check_table_max_rows_modified(char **newval, void **extra, GucSource source)
+{
+    char *badItem = NULL;
+
+    if ( !tableRowLimitsValid(*newval, &badItem) ) {
+        GUC_check_errdetail("invalid entry \"%s\", expected \"schema.table:N\" or \"table:N\" "
+                            "with a non-negative integer N", badItem);
+        return false;
+    }
+
+    return true;
+}
+
+/* es_query_cxt 被删除时 (ExecutorEnd 或事务回滚) 摘除该 EState 的计数器 */
+static void rowGuardReset(void *arg)
+{
+    EState        *estate = (EState *) arg;
+    RowGuardPlan **prev = &rowGuardPlans;
+    RowGuardPlan  *gp;
+
+    rowGuardLast = NULL;
+
+    while ( (gp = *prev) != NULL ) {
+        if ( gp->subplan->state == estate )
+            *prev = gp->next;
+        else
+            prev = &gp->next;
+    }
+}
+
+static void my_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction,
+                           uint64 count, bool execute_once)
+{
+    if ( rowGuardActive() && queryDesc->planstate != NULL ) {
+        rowGuardInstall(queryDesc);
+    }
+
+    if (prev_ExecutorRun_hook) {
+        prev_ExecutorRun_hook(queryDesc, direction, count, execute_once);
+    } else {
+        standard_ExecutorRun(queryDesc, direction, count, execute_once);
+    }
+}
+
+/*
+ * WITH 子句中的 UPDATE/DELETE 可能在 ExecutorFinish 里才执行完，
+ * 计数器一直保留到这里之后，由 es_query_cxt 的回调统一摘除．
+ */
+static void my_ExecutorFinish(QueryDesc *queryDesc)
+{
+    if (prev_ExecutorFinish_hook) {
+        prev_ExecutorFinish_hook(queryDesc);
+    } else {
+        standard_ExecutorFinish(queryDesc);
+    }
+
+    rowGuardLast = NULL;
+}
+
+static void my_shmem_startup(void)
+{
+    if (prev_shmem_startup_hook) {
+        prev_shmem_startup_hook();
+    }
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+    indexAdvisorShmemInit();
+    LWLockRelease(AddinShmemInitLock);
+}
+
 static void my_post_parse_analyze(ParseState *pstate, Query *query)
 {
+    MemoryContext oldcxt;
+
     if ( !pgsword_enabled ) {
         goto NOT_ENABLED;
     }
 
+    // 检查 WHERE 条件是否用得上已有的索引
+    oldcxt = auditMemoryBegin();
+    checkSargability(query);
+    auditMemoryCheck();
+    auditMemoryEnd(oldcxt);
+
 NOT_ENABLED:
     if (prev_post_parse_analyze_hook) {
         prev_post_parse_analyze_hook(pstate, query);
@@ -85,12 +449,16 @@ static void my_process_utility(PlannedStmt *pstmt,
     bool        can_be_run = false;
     List       *stmts;
     ListCell   *l;
+    MemoryContext oldcxt;
     Node *parsetree = pstmt->utilityStmt;
     bool  isTopLevel = (context == PROCESS_UTILITY_TOPLEVEL);
 
     if ( !pgsword_enabled )
         goto NOT_ENABLED;
 
+    // 审核时的分配都放在审核上下文里，审核结束就释放
+    oldcxt = auditMemoryBegin();
+
     // 自己加入的逻辑
     switch ( nodeTag(parsetree) ) {
         /* create tablespace */
@@ -141,10 +509,32 @@ static void my_process_utility(PlannedStmt *pstmt,
                 if ( IsA(stmt, CreateStmt) ) {
                     dispCreateStmt((CreateStmt *) stmt);
                     checkRule((CreateStmt *) stmt);
+                    checkColumnAlignment((CreateStmt *) stmt);
+                    checkRowWidth((CreateStmt *) stmt);
+                    checkCreateForeignKeys((CreateStmt *) stmt, stmts, queryString);
                 }
+                auditMemoryCheck();
             }
             break;
 
+        /* alter table */
+        case T_AlterTableStmt:
+            ereport(NOTICE,
+                (errcode(ERRCODE_SUCCESSFUL_COMPLETION),
+                    errmsg("QunarSQLAudit: found an ALTER TABLE stmt")));
+            checkAlterForeignKeys((AlterTableStmt *) parsetree, queryString);
+            break;
+
+        /* create table as, select into, create materialized view */
+        case T_CreateTableAsStmt:
+            ereport(NOTICE,
+                (errcode(ERRCODE_SUCCESSFUL_COMPLETION),
+                    errmsg("QunarSQLAudit: found a CREATE TABLE AS stmt")));
+            checkDBObjName(((CreateTableAsStmt *) parsetree)->into->rel->relname,
+                           T_CreateTableAsStmt);
+            checkCreateTableAs((CreateTableAsStmt *) parsetree, params, true);
+            break;
+
         /* create view */
         case T_ViewStmt:
             ereport(NOTICE,
@@ -161,11 +551,25 @@ static void my_process_utility(PlannedStmt *pstmt,
                     errmsg("QunarSQLAudit: found a CREATE INDEX stmt")));
             dispStmt(pstmt);
             checkDBObjName(getCreateName(parsetree, T_IndexStmt), T_IndexStmt);
+            checkIndexBuild((IndexStmt *) parsetree);
             break;
 
-        /*case T_CreateTrigStmt:
+        /* create function */
+        case T_CreateFunctionStmt:
+            ereport(NOTICE,
+                (errcode(ERRCODE_SUCCESSFUL_COMPLETION),
+                    errmsg("QunarSQLAudit: found a CREATE FUNCTION stmt")));
+            checkCreateFunction((CreateFunctionStmt *) parsetree);
+            break;
 
-            break;*/
+        /* create trigger */
+        case T_CreateTrigStmt:
+            ereport(NOTICE,
+                (errcode(ERRCODE_SUCCESSFUL_COMPLETION),
+                    errmsg("QunarSQLAudit: found a CREATE TRIGGER stmt")));
+            dispStmt(pstmt);
+            checkCreateTrigger((CreateTrigStmt *) parsetree);
+            break;
 
         /* set stmt */
         case T_VariableSetStmt:
@@ -181,31 +585,74 @@ static void my_process_utility(PlannedStmt *pstmt,
         case T_TruncateStmt:
             dispStmt(pstmt);
             ereport(WARNING, (errmsg("线上数据库慎用 TRUNCATE")));
+            break;
+
+        /* drop stmt */
+        case T_DropStmt:
+            ereport(NOTICE,
+                (errcode(ERRCODE_SUCCESSFUL_COMPLETION),
+                    errmsg("QunarSQLAudit: found a DROP stmt")));
+            dispStmt(pstmt);
+            if ( ((DropStmt *) parsetree)->removeType == OBJECT_TABLE ) {
+                ereport(WARNING, (errmsg("线上数据库慎用 DROP TABLE")));
+            }
+            break;
+
         default:
             break;
     }
 
+    auditMemoryCheck();
+    auditMemoryEnd(oldcxt);
+
     if ( !can_be_run ) {
         finishAudit();
     }
 
 
 NOT_ENABLED:
-    // 执行 pg 原有逻辑
-    if (prev_ProcessUtility_hook) {
-        prev_ProcessUtility_hook(pstmt,
-                                 queryString, context,
-                                 params,
-                                 queryEnv,
-                                 dest, completionTag);
+    // 大表的 DROP/TRUNCATE 改为移入隔离 schema，由后台进程慢慢回收
+    pstmt = deferDropTruncate(pstmt);
+    if ( pstmt == NULL ) {
+        return;
+    }
 
-    } else {
-        standard_ProcessUtility(pstmt,
-                                queryString, context,
-                                params,
-                                queryEnv,
-                                dest, completionTag);
+    // 结果过大的 CTAS 在真正执行前拦下，规划的结果留给执行时用
+    if ( IsA(pstmt->utilityStmt, CreateTableAsStmt) ) {
+        checkCreateTableAs((CreateTableAsStmt *) pstmt->utilityStmt, params, false);
     }
+
+    // 大关系上的 VACUUM FULL/CLUSTER/REINDEX 放进队列，在维护窗口内执行
+    if ( queueMaintenance(pstmt) ) {
+        return;
+    }
+
+    // 执行 pg 原有逻辑
+    PG_TRY();
+    {
+        if (prev_ProcessUtility_hook) {
+            prev_ProcessUtility_hook(pstmt,
+                                     queryString, context,
+                                     params,
+                                     queryEnv,
+                                     dest, completionTag);
+
+        } else {
+            standard_ProcessUtility(pstmt,
+                                    queryString, context,
+                                    params,
+                                    queryEnv,
+                                    dest, completionTag);
+        }
+    }
+    PG_CATCH();
+    {
+        forgetCtasPlan();
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+
+    forgetCtasPlan();
 }
 
 
@@ -222,16 +669,353 @@ void _PG_init(void) {
                              NULL,
                              NULL);
 
+    DefineCustomIntVariable("pgsword.max_rows_modified",
+                            "单条 UPDATE/DELETE 最多可修改的行数，-1 表示不限",
+                            "可以用 ALTER ROLE ... SET 按角色设置",
+                            &pgsword_max_rows_modified,
+                            -1,
+                            -1,
+                            INT_MAX,
+                            PGC_SUSET,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomStringVariable("pgsword.table_max_rows_modified",
+                               "按表设置 UPDATE/DELETE 最多可修改的行数",
+                               "格式: \"schema.table:N, table:N\"",
+                               &pgsword_table_max_rows_modified,
+                               "",
+                               PGC_SUSET,
+                               0,
+                               check_table_max_rows_modified,
+                               NULL,
+                               NULL);
+
+    DefineCustomIntVariable("pgsword.deferred_drop_threshold",
+                            "超过这个大小的表，DROP/TRUNCATE 改为移入隔离 schema 后台回收，-1 表示关闭",
+                            NULL,
+                            &pgsword_deferred_drop_threshold,
+                            -1,
+                            -1,
+                            INT_MAX,
+                            PGC_SUSET,
+                            GUC_UNIT_MB,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomStringVariable("pgsword.quarantine_schema",
+                               "延迟回收的表被移入的 schema",
+                               NULL,
+                               &pgsword_quarantine_schema,
+                               "pgsword_quarantine",
+                               PGC_SIGHUP,
+                               0,
+                               NULL,
+                               NULL,
+                               NULL);
+
+    DefineCustomIntVariable("pgsword.reclaim_rate",
+                            "后台回收进程每秒最多释放的空间",
+                            NULL,
+                            &pgsword_reclaim_rate,
+                            64,
+                            1,
+                            INT_MAX,
+                            PGC_SIGHUP,
+                            GUC_UNIT_MB,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomStringVariable("pgsword.reclaim_database",
+                               "后台回收进程连接的数据库，为空表示不启动",
+                               NULL,
+                               &pgsword_reclaim_database,
+                               "",
+                               PGC_POSTMASTER,
+                               0,
+                               NULL,
+                               NULL,
+                               NULL);
+
+    DefineCustomIntVariable("pgsword.index_concurrently_threshold",
+                            "超过这个大小的表，CREATE INDEX 必须带 CONCURRENTLY，-1 表示不检查",
+                            NULL,
+                            &pgsword_index_concurrently_threshold,
+                            1024,
+                            -1,
+                            INT_MAX,
+                            PGC_SUSET,
+                            GUC_UNIT_MB,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomIntVariable("pgsword.alignment_waste_threshold",
+                            "调整列顺序每行能省下的字节超过这个值时给出 WARNING，-1 表示只给 NOTICE",
+                            NULL,
+                            &pgsword_alignment_waste_threshold,
+                            8,
+                            -1,
+                            BLCKSZ,
+                            PGC_SUSET,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomStringVariable("pgsword.update_heavy_tables",
+                               "频繁 UPDATE 的表，建表时检查 fillfactor 是否给 HOT 留了空间",
+                               "格式: \"schema.table, table\"",
+                               &pgsword_update_heavy_tables,
+                               "",
+                               PGC_USERSET,
+                               0,
+                               NULL,
+                               NULL,
+                               NULL);
+
+    DefineCustomBoolVariable("pgsword.reject_unindexed_fk",
+                             "外键引用列上没有索引时拒绝，关闭时只给出建议的索引",
+                             NULL,
+                             &pgsword_reject_unindexed_fk,
+                             false,
+                             PGC_SUSET,
+                             0,
+                             NULL,
+                             NULL,
+                             NULL);
+
+    DefineCustomBoolVariable("pgsword.enforce_function_volatility",
+                             "CREATE FUNCTION 声明的 volatility 和 PARALLEL 与函数体推导的不一致时拒绝，关闭时只给出建议",
+                             NULL,
+                             &pgsword_enforce_function_volatility,
+                             false,
+                             PGC_SUSET,
+                             0,
+                             NULL,
+                             NULL,
+                             NULL);
+
+    DefineCustomIntVariable("pgsword.row_trigger_max_write_rate",
+                            "表每秒写入行数超过这个值时，审核其上的 FOR EACH ROW 触发器，-1 表示不检查",
+                            NULL,
+                            &pgsword_row_trigger_max_write_rate,
+                            1000,
+                            -1,
+                            INT_MAX,
+                            PGC_SUSET,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomBoolVariable("pgsword.reject_row_trigger",
+                             "写入频繁的表上的 FOR EACH ROW 触发器直接拒绝，关闭时只给出警告",
+                             NULL,
+                             &pgsword_reject_row_trigger,
+                             false,
+                             PGC_SUSET,
+                             0,
+                             NULL,
+                             NULL,
+                             NULL);
+
+    DefineCustomStringVariable("pgsword.index_advisor_database",
+                               "索引采样后台进程连接的数据库，为空表示不启动",
+                               NULL,
+                               &pgsword_index_advisor_database,
+                               "",
+                               PGC_POSTMASTER,
+                               0,
+                               NULL,
+                               NULL,
+                               NULL);
+
+    DefineCustomIntVariable("pgsword.index_advisor_window",
+                            "统计索引扫描次数的时间窗口",
+                            NULL,
+                            &pgsword_index_advisor_window,
+                            7 * 24 * 3600,
+                            60,
+                            INT_MAX / 1000,
+                            PGC_SIGHUP,
+                            GUC_UNIT_S,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomIntVariable("pgsword.index_advisor_max_indexes",
+                            "索引采样最多跟踪的索引数 (按大小取前 N 个)",
+                            NULL,
+                            &pgsword_index_advisor_max_indexes,
+                            2000,
+                            100,
+                            1000000,
+                            PGC_POSTMASTER,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomIntVariable("pgsword.ctas_max_size",
+                            "CREATE TABLE AS 等语句结果的预算，超过时必须是 UNLOGGED 或建在专用表空间上，-1 表示不检查",
+                            NULL,
+                            &pgsword_ctas_max_size,
+                            -1,
+                            -1,
+                            INT_MAX,
+                            PGC_SUSET,
+                            GUC_UNIT_MB,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomStringVariable("pgsword.ctas_tablespace",
+                               "超过 pgsword.ctas_max_size 的 CREATE TABLE AS 可以使用的专用表空间",
+                               NULL,
+                               &pgsword_ctas_tablespace,
+                               "",
+                               PGC_SUSET,
+                               0,
+                               NULL,
+                               NULL,
+                               NULL);
+
+    DefineCustomIntVariable("pgsword.maintenance_threshold",
+                            "超过这个大小的关系上的 VACUUM FULL，CLUSTER，REINDEX 放进队列，在维护窗口内执行，-1 表示立即执行",
+                            NULL,
+                            &pgsword_maintenance_threshold,
+                            -1,
+                            -1,
+                            INT_MAX,
+                            PGC_SUSET,
+                            GUC_UNIT_MB,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomStringVariable("pgsword.maintenance_window",
+                               "维护窗口，格式 \"HH:MM-HH:MM[, ...]\"，服务器时区",
+                               NULL,
+                               &pgsword_maintenance_window,
+                               "",
+                               PGC_SIGHUP,
+                               0,
+                               NULL,
+                               NULL,
+                               NULL);
+
+    DefineCustomStringVariable("pgsword.maintenance_database",
+                               "维护队列所在的数据库，为空时不启动后台执行进程",
+                               NULL,
+                               &pgsword_maintenance_database,
+                               "",
+                               PGC_POSTMASTER,
+                               0,
+                               NULL,
+                               NULL,
+                               NULL);
+
+    DefineCustomIntVariable("pgsword.maintenance_io_rate",
+                            "维护任务平均每秒处理的数据量",
+                            NULL,
+                            &pgsword_maintenance_io_rate,
+                            64,
+                            1,
+                            INT_MAX,
+                            PGC_SIGHUP,
+                            GUC_UNIT_MB,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomIntVariable("pgsword.maintenance_lock_timeout",
+                            "维护任务等锁的最长时间，超时后留到下次重试",
+                            NULL,
+                            &pgsword_maintenance_lock_timeout,
+                            10000,
+                            0,
+                            INT_MAX,
+                            PGC_SIGHUP,
+                            GUC_UNIT_MS,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomIntVariable("pgsword.audit_workers",
+                            "pgsword_audit_script() 并行审核最多使用的后台进程数 (不超过 max_parallel_workers)，0 表示只在当前后端审核",
+                            NULL,
+                            &pgsword_audit_workers,
+                            4,
+                            0,
+                            1024,
+                            PGC_SUSET,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomIntVariable("pgsword.audit_memory_limit",
+                            "审核一条语句最多使用的内存，超过时作为审核错误报告，-1 表示不限",
+                            NULL,
+                            &pgsword_audit_memory_limit,
+                            65536,
+                            -1,
+                            MAX_KILOBYTES,
+                            PGC_SUSET,
+                            GUC_UNIT_KB,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    if ( process_shared_preload_libraries_in_progress ) {
+        RequestAddinShmemSpace(indexAdvisorShmemSize());
+        RequestNamedLWLockTranche("pgsword", 1);
+
+        prev_shmem_startup_hook = shmem_startup_hook;
+        shmem_startup_hook = my_shmem_startup;
+
+        if ( pgsword_reclaim_database[0] != '\0' ) {
+            registerReclaimWorker();
+        }
+
+        if ( pgsword_index_advisor_database[0] != '\0' ) {
+            registerIndexAdvisorWorker();
+        }
+
+        if ( pgsword_maintenance_database[0] != '\0' ) {
+            registerMaintenanceWorker();
+        }
+    }
+
+    initSargCache();
+    initBatchAudit();
+    initAuditMemory();
+
     prev_post_parse_analyze_hook = post_parse_analyze_hook;
     post_parse_analyze_hook = my_post_parse_analyze;
+    prev_planner_hook = planner_hook;
+    planner_hook = my_planner;
     //prev_ExecutorStart_hook = ExecutorStart_hook;
     //ExecutorStart_hook = my_ExecutorStart;
+    prev_ExecutorRun_hook = ExecutorRun_hook;
+    ExecutorRun_hook = my_ExecutorRun;
+    prev_ExecutorFinish_hook = ExecutorFinish_hook;
+    ExecutorFinish_hook = my_ExecutorFinish;
     prev_ProcessUtility_hook = ProcessUtility_hook;
     ProcessUtility_hook = my_process_utility;
 }
 
 void _PG_fini(void) {
     post_parse_analyze_hook = prev_post_parse_analyze_hook;
+    planner_hook = prev_planner_hook;
     ProcessUtility_hook = prev_ProcessUtility_hook;
     //ExecutorStart_hook = prev_ExecutorStart_hook;
+    shmem_startup_hook = prev_shmem_startup_hook;
+    ExecutorRun_hook = prev_ExecutorRun_hook;
+    ExecutorFinish_hook = prev_ExecutorFinish_hook;
 }
@@ -1,6 +1,31 @@
 #ifndef _Qunar_SQL_Audit_H
 #define _Qunar_SQL_Audit_H
 
-
+/* GUC 变量，定义在 pgsword.c */
+extern int   pgsword_max_rows_modified;
+extern char *pgsword_table_max_rows_modified;
+extern int   pgsword_deferred_drop_threshold;
+extern char *pgsword_quarantine_schema;
+extern int   pgsword_reclaim_rate;
+extern char *pgsword_reclaim_database;
+extern int   pgsword_index_concurrently_threshold;
+extern int   pgsword_alignment_waste_threshold;
+extern char *pgsword_update_heavy_tables;
+extern bool  pgsword_reject_unindexed_fk;
+extern bool  pgsword_enforce_function_volatility;
+extern int   pgsword_row_trigger_max_write_rate;
+extern bool  pgsword_reject_row_trigger;
+extern char *pgsword_index_advisor_database;
+extern int   pgsword_index_advisor_window;
+extern int   pgsword_index_advisor_max_indexes;
+extern int   pgsword_ctas_max_size;
+extern char *pgsword_ctas_tablespace;
+extern int   pgsword_maintenance_threshold;
+extern char *pgsword_maintenance_window;
+extern char *pgsword_maintenance_database;
+extern int   pgsword_maintenance_io_rate;
+extern int   pgsword_maintenance_lock_timeout;
+extern int   pgsword_audit_workers;
+extern int   pgsword_audit_memory_limit;
 
 #endif
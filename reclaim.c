@@ -0,0 +1,746 @@
+/* -------------------------------------------------------------------------
+ *
+ * reclaim.c
+ *
+ *   大表 DROP/TRUNCATE 的延迟回收．
+ *
+ *   DROP 或 TRUNCATE 一张 1TB 的表，会在提交时一次性 unlink 上千个
+ * 段文件，主库和备库的 I/O 都会卡住．
+ *   打开 pgsword.deferred_drop_threshold 后，超过阈值的表不再真正删除，
+ * 而是被移进隔离 schema (pgsword.quarantine_schema) 并改名，用户的语句
+ * 立刻返回；后台进程 pgsword reclaim 再按 pgsword.reclaim_rate 的速度
+ * 从文件尾部一段段截断，截完后才真正 DROP．截断会写 WAL，备库上也是
+ * 按同样的节奏释放空间．
+ *
+ * Copyright (c) 2017-2017, Qunar DBA Group
+ *
+ * IDENTIFICATION
+ *      contrib/pgsword/reclaim.c
+ *
+ * -------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include <signal.h>
+
+#include "access/genam.h"
+#include "access/heapam.h"
+#include "access/htup_details.h"
+#include "access/xact.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_authid.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_type.h"
+#include "catalog/storage.h"
+#include "commands/dbcommands.h"
+#include "executor/spi.h"
+#include "lib/stringinfo.h"
+#include "mb/pg_wchar.h"
+#include "miscadmin.h"
+#include "nodes/makefuncs.h"
+#include "nodes/parsenodes.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "storage/bufmgr.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lmgr.h"
+#include "storage/proc.h"
+#include "utils/acl.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/lsyscache.h"
+#include "utils/rel.h"
+#include "utils/snapmgr.h"
+#include "utils/syscache.h"
+#include "utils/timestamp.h"
+
+#include "pgsword.h"
+#include "reclaim.h"
+
+/* 后台进程没有待回收的表时的轮询间隔 */
+#define RECLAIM_NAPTIME_MS   10000L
+
+/* 回收失败的表第一次重试前等待的时间，之后每次加倍，最多一小时 */
+#define RECLAIM_RETRY_MIN_MS      60000L
+#define RECLAIM_RETRY_MAX_MS    3600000L
+
+static volatile sig_atomic_t got_sighup = false;
+static volatile sig_atomic_t got_sigterm = false;
+
+/* 回收出错的表，重试时间到之前跳过它，别的表照常回收 */
+typedef struct ReclaimFailure {
+    Oid         relid;
+    int         failures;
+    TimestampTz nextTry;
+} ReclaimFailure;
+
+static List *reclaimFailures = NIL;
+
+/*
+ * 能被移入隔离 schema 的表：普通的持久表 (临时表不能移出临时 schema)，
+ * 没有别的对象依赖它，不是继承的子表，也不是已经在隔离 schema 里的表
+ * (回收进程自己最后的 DROP 不能再被拦下)．
+ */
+static const char *dropEligibleSql =
+    "SELECT c.relkind = 'r'"
+    "   AND c.relpersistence = 'p'"
+    "   AND c.relnamespace <> ALL (SELECT n.oid FROM pg_catalog.pg_namespace n"
+    "                              WHERE n.nspname = pg_catalog.current_setting('pgsword.quarantine_schema'))"
+    "   AND NOT c.relhassubclass"
+    "   AND NOT c.relispartition"
+    "   AND NOT EXISTS (SELECT 1 FROM pg_catalog.pg_inherits i"
+    "                   WHERE i.inhrelid = c.oid)"
+    "   AND NOT EXISTS (SELECT 1 FROM pg_catalog.pg_depend d"
+    "                   WHERE d.refclassid = 'pg_catalog.pg_class'::pg_catalog.regclass"
+    "                     AND d.refobjid = c.oid"
+    "                     AND d.classid = 'pg_catalog.pg_rewrite'::pg_catalog.regclass)"
+    "   AND NOT EXISTS (SELECT 1 FROM pg_catalog.pg_depend d"
+    "                   WHERE d.refclassid = 'pg_catalog.pg_type'::pg_catalog.regclass"
+    "                     AND d.refobjid = c.reltype"
+    "                     AND d.deptype = 'n')"
+    "   AND NOT EXISTS (SELECT 1 FROM pg_catalog.pg_constraint f"
+    "                   WHERE f.contype = 'f'"
+    "                     AND f.confrelid = c.oid"
+    "                     AND f.conrelid <> c.oid)"
+    "  FROM pg_catalog.pg_class c WHERE c.oid = $1";
+
+/*
+ * TRUNCATE 是用 CREATE TABLE ... (LIKE ... INCLUDING ALL) 重建一张空表，
+ * LIKE 带不过来的属性 (权限，列权限，行级安全策略，发布，触发器，外键，
+ * 存储参数，表空间，identity) 有任何一个，就还是走原生的 TRUNCATE．
+ */
+static const char *truncateEligibleSql =
+    "SELECT c.relpersistence = 'p'"
+    "   AND c.relacl IS NULL"
+    "   AND NOT c.relrowsecurity"
+    "   AND NOT c.relforcerowsecurity"
+    "   AND NOT EXISTS (SELECT 1 FROM pg_catalog.pg_policy p WHERE p.polrelid = c.oid)"
+    "   AND NOT EXISTS (SELECT 1 FROM pg_catalog.pg_attribute a"
+    "                   WHERE a.attrelid = c.oid AND a.attacl IS NOT NULL)"
+    "   AND NOT EXISTS (SELECT 1 FROM pg_catalog.pg_publication_rel r WHERE r.prrelid = c.oid)"
+    "   AND c.reloptions IS NULL"
+    "   AND c.reltablespace = 0"
+    "   AND NOT c.relhastriggers"
+    "   AND NOT EXISTS (SELECT 1 FROM pg_catalog.pg_attribute a"
+    "                   WHERE a.attrelid = c.oid AND a.attidentity <> '')"
+    "  FROM pg_catalog.pg_class c WHERE c.oid = $1";
+
+/* 表上 SERIAL 列拥有的 sequence */
+static const char *ownedSeqSql =
+    "SELECT pg_catalog.quote_ident(sn.nspname) || '.' || pg_catalog.quote_ident(s.relname),"
+    "       pg_catalog.quote_ident(a.attname)"
+    "  FROM pg_catalog.pg_depend d"
+    "  JOIN pg_catalog.pg_class s ON s.oid = d.objid AND s.relkind = 'S'"
+    "  JOIN pg_catalog.pg_namespace sn ON sn.oid = s.relnamespace"
+    "  JOIN pg_catalog.pg_attribute a ON a.attrelid = d.refobjid AND a.attnum = d.refobjsubid"
+    " WHERE d.classid = 'pg_catalog.pg_class'::pg_catalog.regclass"
+    "   AND d.refclassid = 'pg_catalog.pg_class'::pg_catalog.regclass"
+    "   AND d.refobjid = $1 AND d.deptype = 'a'";
+
+static const char *outgoingFkSql =
+    "SELECT pg_catalog.quote_ident(conname) FROM pg_catalog.pg_constraint"
+    " WHERE conrelid = $1 AND contype = 'f'";
+
+static bool spiCheckRelation(const char *sql, Oid relid);
+static void spiExec(const char *sql);
+static bool quarantineRelation(Oid relid, bool forTruncate);
+static bool reclaimOneStep(void);
+
+/* relationTotalBytes - 表，TOAST 和所有索引的总大小 */
+int64 relationTotalBytes(Oid relid) {
+    return DatumGetInt64(DirectFunctionCall1(pg_total_relation_size,
+                                             ObjectIdGetDatum(relid)));
+}
+
+static bool spiCheckRelation(const char *sql, Oid relid) {
+    Oid    argtypes[1] = { OIDOID };
+    Datum  values[1];
+    bool   isnull;
+    Datum  result;
+
+    values[0] = ObjectIdGetDatum(relid);
+    if ( SPI_execute_with_args(sql, 1, argtypes, values, NULL, true, 1) != SPI_OK_SELECT ) {
+        elog(ERROR, "pgsword: SPI_execute_with_args failed: %s", sql);
+    }
+    if ( SPI_processed != 1 ) {
+        return false;
+    }
+
+    result = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull);
+    return !isnull && DatumGetBool(result);
+}
+
+static void spiExec(const char *sql) {
+    if ( SPI_execute(sql, false, 0) < 0 ) {
+        elog(ERROR, "pgsword: SPI_execute failed: %s", sql);
+    }
+}
+
+/*
+ * quarantineRelation - 把一张表移进隔离 schema
+ *
+ *   DROP:     RENAME + SET SCHEMA，再删掉它指向别的表的外键，
+ *             不然父表上的 DELETE 还会去检查它．
+ *   TRUNCATE: 先把原表移走，再在原 schema 里用 LIKE 建一张同名空表，
+ *             SERIAL 列的 sequence 转给新表．
+ *
+ *   需要建 schema，改表属主，所以这里临时切换到 superuser 执行，
+ * 调用方已经检查过当前用户是表的属主 (DROP) 或者有 TRUNCATE 权限．
+ *   返回 false 表示这张表不适合延迟回收，走原生逻辑．
+ */
+static bool quarantineRelation(Oid relid, bool forTruncate) {
+    char           *nspname = get_namespace_name(get_rel_namespace(relid));
+    char           *relname = get_rel_name(relid);
+    const char     *qschema = quote_identifier(pgsword_quarantine_schema);
+    char            qrelname[NAMEDATALEN];
+    const char     *qname;
+    Oid             ownerId;
+    HeapTuple       tuple;
+    Oid             save_userid;
+    int             save_sec_context;
+    int             cliplen;
+    uint64          i;
+    StringInfoData  buf;
+
+    if ( SPI_connect() != SPI_OK_CONNECT ) {
+        elog(ERROR, "pgsword: SPI_connect failed");
+    }
+
+    if ( !spiCheckRelation(dropEligibleSql, relid)
+        ||
+         (forTruncate && !spiCheckRelation(truncateEligibleSql, relid)) ) {
+        SPI_finish();
+        return false;
+    }
+
+    // 隔离后的名字: 原名_oid，保证唯一，同时 DBA 还能认出原表
+    cliplen = pg_mbcliplen(relname, strlen(relname), NAMEDATALEN - 12);
+    snprintf(qrelname, NAMEDATALEN, "%.*s_%u", cliplen, relname, relid);
+    qname = quote_qualified_identifier(pgsword_quarantine_schema, qrelname);
+
+    // superuser 也能 TRUNCATE 别人的表，新表要还给原属主
+    tuple = SearchSysCache1(RELOID, ObjectIdGetDatum(relid));
+    if ( !HeapTupleIsValid(tuple) ) {
+        elog(ERROR, "pgsword: cache lookup failed for relation %u", relid);
+    }
+    ownerId = ((Form_pg_class) GETSTRUCT(tuple))->relowner;
+    ReleaseSysCache(tuple);
+
+    GetUserIdAndSecContext(&save_userid, &save_sec_context);
+    SetUserIdAndSecContext(BOOTSTRAP_SUPERUSERID,
+                           save_sec_context | SECURITY_LOCAL_USERID_CHANGE);
+
+    initStringInfo(&buf);
+
+    appendStringInfo(&buf, "CREATE SCHEMA IF NOT EXISTS %s", qschema);
+    spiExec(buf.data);
+
+    // 先改名再移走，隔离 schema 里可能已经有同名的表
+    resetStringInfo(&buf);
+    appendStringInfo(&buf, "ALTER TABLE %s RENAME TO %s",
+                     quote_qualified_identifier(nspname, relname),
+                     quote_identifier(qrelname));
+    spiExec(buf.data);
+
+    resetStringInfo(&buf);
+    appendStringInfo(&buf, "ALTER TABLE %s SET SCHEMA %s",
+                     quote_qualified_identifier(nspname, qrelname), qschema);
+    spiExec(buf.data);
+
+    if ( forTruncate ) {
+        Oid    argtypes[1] = { OIDOID };
+        Datum  values[1];
+        const char *newname = quote_qualified_identifier(nspname, relname);
+
+        resetStringInfo(&buf);
+        appendStringInfo(&buf, "CREATE TABLE %s (LIKE %s INCLUDING ALL)", newname, qname);
+        spiExec(buf.data);
+
+        resetStringInfo(&buf);
+        appendStringInfo(&buf, "ALTER TABLE %s OWNER TO %s", newname,
+                         quote_identifier(GetUserNameFromId(ownerId, false)));
+        spiExec(buf.data);
+
+        values[0] = ObjectIdGetDatum(relid);
+        if ( SPI_execute_with_args(ownedSeqSql, 1, argtypes, values, NULL, true, 0) != SPI_OK_SELECT ) {
+            elog(ERROR, "pgsword: SPI_execute_with_args failed: %s", ownedSeqSql);
+        }
+
+        if ( SPI_processed > 0 ) {
+            SPITupleTable *tuptable = SPI_tuptable;
+            uint64         nseqs = SPI_processed;
+
+            // TRUNCATE 不带 RESTART IDENTITY 时 sequence 不变，
+            // 先改 OWNED BY 才能把它移回原 schema
+            for ( i = 0; i < nseqs; i++ ) {
+                char *seqname = SPI_getvalue(tuptable->vals[i], tuptable->tupdesc, 1);
+                char *colname = SPI_getvalue(tuptable->vals[i], tuptable->tupdesc, 2);
+
+                resetStringInfo(&buf);
+                appendStringInfo(&buf, "ALTER SEQUENCE %s OWNED BY %s.%s",
+                                 seqname, newname, colname);
+                spiExec(buf.data);
+
+                resetStringInfo(&buf);
+                appendStringInfo(&buf, "ALTER SEQUENCE %s SET SCHEMA %s",
+                                 seqname, quote_identifier(nspname));
+                spiExec(buf.data);
+            }
+        }
+    }
+    else {
+        Oid    argtypes[1] = { OIDOID };
+        Datum  values[1];
+
+        values[0] = ObjectIdGetDatum(relid);
+        if ( SPI_execute_with_args(outgoingFkSql, 1, argtypes, values, NULL, true, 0) != SPI_OK_SELECT ) {
+            elog(ERROR, "pgsword: SPI_execute_with_args failed: %s", outgoingFkSql);
+        }
+
+        if ( SPI_processed > 0 ) {
+            SPITupleTable *tuptable = SPI_tuptable;
+            uint64         nfks = SPI_processed;
+
+            for ( i = 0; i < nfks; i++ ) {
+                resetStringInfo(&buf);
+                appendStringInfo(&buf, "ALTER TABLE %s DROP CONSTRAINT %s", qname,
+                                 SPI_getvalue(tuptable->vals[i], tuptable->tupdesc, 1));
+                spiExec(buf.data);
+            }
+        }
+    }
+
+    SetUserIdAndSecContext(save_userid, save_sec_context);
+
+    SPI_finish();
+
+    ereport(NOTICE,
+            (errcode(ERRCODE_SUCCESSFUL_COMPLETION),
+                errmsg("QunarSQLAudit: table \"%s.%s\" moved to %s, "
+                       "its storage will be reclaimed in background",
+                       nspname, relname, qname)));
+
+    return true;
+}
+
+/*
+ * 拿锁之前的权限检查，和原生命令要求的权限一样：
+ * DROP 要求是属主，TRUNCATE 要求有 TRUNCATE 权限．
+ */
+static void deferLookupCallback(const RangeVar *relation, Oid relId, Oid oldRelId,
+                                void *arg) {
+    bool      forTruncate = *(bool *) arg;
+    AclResult aclresult;
+
+    if ( !OidIsValid(relId) ) {
+        return;
+    }
+
+    if ( forTruncate ) {
+        aclresult = pg_class_aclcheck(relId, GetUserId(), ACL_TRUNCATE);
+        if ( aclresult != ACLCHECK_OK ) {
+            aclcheck_error(aclresult, ACL_KIND_CLASS, relation->relname);
+        }
+    }
+    else if ( !pg_class_ownercheck(relId, GetUserId()) ) {
+        aclcheck_error(ACLCHECK_NOT_OWNER, ACL_KIND_CLASS, relation->relname);
+    }
+}
+
+/*
+ * deferDropTruncate - 在 DROP TABLE / TRUNCATE 真正执行前拦截大表
+ *
+ *   超过 pgsword.deferred_drop_threshold 且适合隔离的表被移走，
+ * 并从语句里去掉．剩下的表仍然交给 PG 原有逻辑处理．
+ *   返回 NULL 表示语句里的表都已处理，不需要再执行．
+ */
+PlannedStmt *deferDropTruncate(PlannedStmt *pstmt) {
+    Node        *parsetree = pstmt->utilityStmt;
+    PlannedStmt *newpstmt;
+    List        *remaining = NIL;
+    ListCell    *l;
+    bool         forTruncate;
+    bool         changed = false;
+    int64        threshold = (int64) pgsword_deferred_drop_threshold * 1024 * 1024;
+
+    if ( pgsword_deferred_drop_threshold < 0 ) {
+        return pstmt;
+    }
+
+    // 只有回收进程所在的数据库才能隔离，否则表的空间永远不会被回收
+    if ( pgsword_reclaim_database == NULL || pgsword_reclaim_database[0] == '\0'
+        ||
+         strcmp(get_database_name(MyDatabaseId), pgsword_reclaim_database) != 0 ) {
+        return pstmt;
+    }
+
+    if ( IsA(parsetree, DropStmt) ) {
+        DropStmt *stmt = (DropStmt *) parsetree;
+
+        if ( stmt->removeType != OBJECT_TABLE || stmt->concurrent ) {
+            return pstmt;
+        }
+        forTruncate = false;
+    }
+    else if ( IsA(parsetree, TruncateStmt) ) {
+        // RESTART IDENTITY 要重置 sequence，不拦截
+        if ( ((TruncateStmt *) parsetree)->restart_seqs ) {
+            return pstmt;
+        }
+        forTruncate = true;
+    }
+    else {
+        return pstmt;
+    }
+
+    foreach(l, forTruncate ? ((TruncateStmt *) parsetree)->relations
+                           : ((DropStmt *) parsetree)->objects) {
+        RangeVar *rv;
+        Oid       relid;
+
+        if ( forTruncate ) {
+            rv = (RangeVar *) lfirst(l);
+        }
+        else {
+            rv = makeRangeVarFromNameList((List *) lfirst(l));
+        }
+
+        // 和 DROP/TRUNCATE 一样拿 AccessExclusiveLock，避免检查后表被改；
+        // 拿锁之前先检查权限，否则任何人都能锁住别人的表
+        relid = RangeVarGetRelidExtended(rv, AccessExclusiveLock, true, false,
+                                         deferLookupCallback, (void *) &forTruncate);
+
+        if ( OidIsValid(relid)
+            &&
+             get_rel_relkind(relid) == RELKIND_RELATION
+            &&
+             relationTotalBytes(relid) >= threshold
+            &&
+             quarantineRelation(relid, forTruncate) ) {
+            changed = true;
+            continue;
+        }
+
+        remaining = lappend(remaining, lfirst(l));
+    }
+
+    if ( !changed ) {
+        return pstmt;
+    }
+
+    if ( remaining == NIL ) {
+        return NULL;
+    }
+
+    newpstmt = copyObject(pstmt);
+    if ( forTruncate ) {
+        ((TruncateStmt *) newpstmt->utilityStmt)->relations = remaining;
+    }
+    else {
+        ((DropStmt *) newpstmt->utilityStmt)->objects = remaining;
+    }
+
+    return newpstmt;
+}
+
+/* ---------------------------------------------------------------------- */
+/* 后台回收进程                                                             */
+/* ---------------------------------------------------------------------- */
+
+static void reclaim_sighup(SIGNAL_ARGS) {
+    int save_errno = errno;
+
+    got_sighup = true;
+    SetLatch(MyLatch);
+
+    errno = save_errno;
+}
+
+static void reclaim_sigterm(SIGNAL_ARGS) {
+    int save_errno = errno;
+
+    got_sigterm = true;
+    SetLatch(MyLatch);
+
+    errno = save_errno;
+}
+
+void registerReclaimWorker(void) {
+    BackgroundWorker worker;
+
+    memset(&worker, 0, sizeof(worker));
+    worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+    worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+    worker.bgw_restart_time = 60;
+    snprintf(worker.bgw_name, BGW_MAXLEN, "pgsword reclaim");
+    snprintf(worker.bgw_library_name, BGW_MAXLEN, "pgsword");
+    snprintf(worker.bgw_function_name, BGW_MAXLEN, "pgsword_reclaim_main");
+    worker.bgw_main_arg = (Datum) 0;
+    worker.bgw_notify_pid = 0;
+
+    RegisterBackgroundWorker(&worker);
+}
+
+/* 截断一个关系，最多 budget 个 block，返回实际截掉的 block 数 */
+static BlockNumber truncateTail(Relation rel, BlockNumber budget, bool *empty) {
+    BlockNumber nblocks = RelationGetNumberOfBlocks(rel);
+    BlockNumber newblocks;
+
+    if ( nblocks == 0 || budget == 0 ) {
+        *empty = *empty && nblocks == 0;
+        return 0;
+    }
+
+    newblocks = nblocks > budget ? nblocks - budget : 0;
+    RelationTruncate(rel, newblocks);
+    *empty = *empty && newblocks == 0;
+
+    return nblocks - newblocks;
+}
+
+/* 记一次失败，按失败次数退避 */
+static void noteReclaimFailure(Oid relid) {
+    ReclaimFailure *f = NULL;
+    ListCell       *l;
+    long            delay = RECLAIM_RETRY_MIN_MS;
+    int             i;
+
+    foreach(l, reclaimFailures) {
+        if ( ((ReclaimFailure *) lfirst(l))->relid == relid ) {
+            f = (ReclaimFailure *) lfirst(l);
+            break;
+        }
+    }
+
+    if ( f == NULL ) {
+        MemoryContext oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+
+        f = palloc0(sizeof(ReclaimFailure));
+        f->relid = relid;
+        reclaimFailures = lappend(reclaimFailures, f);
+        MemoryContextSwitchTo(oldcxt);
+    }
+
+    f->failures++;
+    for ( i = 1; i < f->failures && delay < RECLAIM_RETRY_MAX_MS; i++ ) {
+        delay *= 2;
+    }
+    f->nextTry = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+                                             Min(delay, RECLAIM_RETRY_MAX_MS));
+}
+
+static void forgetReclaimFailure(Oid relid) {
+    ListCell *l;
+
+    foreach(l, reclaimFailures) {
+        ReclaimFailure *f = (ReclaimFailure *) lfirst(l);
+
+        if ( f->relid == relid ) {
+            reclaimFailures = list_delete_ptr(reclaimFailures, f);
+            pfree(f);
+            return;
+        }
+    }
+}
+
+/* 还没到重试时间的表，作为 oid[] 参数传给查询 */
+static Datum skippedRelations(void) {
+    TimestampTz now = GetCurrentTimestamp();
+    Datum      *oids = palloc(sizeof(Datum) * (list_length(reclaimFailures) + 1));
+    int         n = 0;
+    ListCell   *l;
+
+    foreach(l, reclaimFailures) {
+        ReclaimFailure *f = (ReclaimFailure *) lfirst(l);
+
+        if ( f->nextTry > now ) {
+            oids[n++] = ObjectIdGetDatum(f->relid);
+        }
+    }
+
+    return PointerGetDatum(construct_array(oids, n, OIDOID, sizeof(Oid), true, 'i'));
+}
+
+/* 截掉一张隔离表的一部分，截空了就 DROP．在调用方的事务里执行 */
+static void reclaimRelation(Oid relid, const char *qname, BlockNumber budget) {
+    bool           empty = true;
+    Relation       rel;
+    List          *indexes;
+    ListCell      *l;
+
+    rel = heap_open(relid, NoLock);
+
+    budget -= truncateTail(rel, budget, &empty);
+
+    if ( OidIsValid(rel->rd_rel->reltoastrelid) ) {
+        Relation  toastrel = heap_open(rel->rd_rel->reltoastrelid, AccessExclusiveLock);
+        List     *toastidx = RelationGetIndexList(toastrel);
+
+        budget -= truncateTail(toastrel, budget, &empty);
+
+        foreach(l, toastidx) {
+            Relation idxrel = index_open(lfirst_oid(l), AccessExclusiveLock);
+
+            budget -= truncateTail(idxrel, budget, &empty);
+            index_close(idxrel, NoLock);
+        }
+        heap_close(toastrel, NoLock);
+    }
+
+    indexes = RelationGetIndexList(rel);
+    foreach(l, indexes) {
+        Relation idxrel = index_open(lfirst_oid(l), AccessExclusiveLock);
+
+        budget -= truncateTail(idxrel, budget, &empty);
+        index_close(idxrel, NoLock);
+    }
+
+    heap_close(rel, NoLock);
+
+    if ( empty ) {
+        StringInfoData buf;
+
+        initStringInfo(&buf);
+        appendStringInfo(&buf, "DROP TABLE %s", qname);
+        spiExec(buf.data);
+
+        ereport(LOG,
+                (errmsg("pgsword: reclaimed quarantined table %s", qname)));
+    }
+}
+
+/*
+ * reclaimOneStep - 从隔离 schema 里取一张表，截掉 pgsword.reclaim_rate
+ * 那么多的数据；表，TOAST 和索引都截空之后再 DROP．
+ *
+ *   表已经没人用了，截断后索引和表对不上也没关系．
+ *   一张表出错 (比如还有视图依赖它，DROP 失败) 只记下来，退避一段
+ * 时间再试，不影响别的表，进程也不会退出．
+ *   返回 true 表示还有活要干，1 秒后再来．
+ */
+static bool reclaimOneStep(void) {
+    Oid            argtypes[2] = { TEXTOID, OIDARRAYOID };
+    Datum          values[2];
+    volatile Oid   relid = InvalidOid;
+    char          *qname;
+    bool           isnull;
+    volatile bool  found = false;
+    BlockNumber    budget;
+    MemoryContext  oldcxt = CurrentMemoryContext;
+
+    budget = (BlockNumber) (((int64) pgsword_reclaim_rate * 1024 * 1024) / BLCKSZ);
+    if ( budget == 0 ) {
+        budget = 1;
+    }
+
+    SetCurrentStatementStartTimestamp();
+    StartTransactionCommand();
+
+    PG_TRY();
+    {
+        SPI_connect();
+        PushActiveSnapshot(GetTransactionSnapshot());
+        pgstat_report_activity(STATE_RUNNING, "pgsword: reclaim quarantined tables");
+
+        values[0] = CStringGetTextDatum(pgsword_quarantine_schema);
+        values[1] = skippedRelations();
+        if ( SPI_execute_with_args("SELECT c.oid, pg_catalog.quote_ident(n.nspname) || '.' || "
+                                   "       pg_catalog.quote_ident(c.relname)"
+                                   "  FROM pg_catalog.pg_class c"
+                                   "  JOIN pg_catalog.pg_namespace n ON n.oid = c.relnamespace"
+                                   " WHERE n.nspname = $1::pg_catalog.name AND c.relkind = 'r'"
+                                   "   AND c.oid <> ALL ($2)"
+                                   " ORDER BY c.oid LIMIT 1",
+                                   2, argtypes, values, NULL, true, 1) != SPI_OK_SELECT ) {
+            elog(ERROR, "pgsword: failed to scan quarantine schema");
+        }
+
+        if ( SPI_processed > 0 ) {
+            relid = DatumGetObjectId(SPI_getbinval(SPI_tuptable->vals[0],
+                                                   SPI_tuptable->tupdesc, 1, &isnull));
+            qname = SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 2);
+
+            // 有人在用 (比如 DBA 正在查看) 就下次再来，不阻塞别人
+            if ( ConditionalLockRelationOid(relid, AccessExclusiveLock) ) {
+                reclaimRelation(relid, qname, budget);
+                found = true;
+            }
+        }
+
+        SPI_finish();
+        PopActiveSnapshot();
+        CommitTransactionCommand();
+
+        if ( found ) {
+            forgetReclaimFailure(relid);
+        }
+    }
+    PG_CATCH();
+    {
+        ErrorData *edata;
+
+        MemoryContextSwitchTo(oldcxt);
+        edata = CopyErrorData();
+        FlushErrorState();
+        AbortCurrentTransaction();
+
+        if ( OidIsValid(relid) ) {
+            noteReclaimFailure(relid);
+        }
+
+        ereport(LOG,
+                (errmsg("pgsword: failed to reclaim quarantined table %u: %s",
+                        relid, edata->message)));
+        FreeErrorData(edata);
+
+        // 换下一张表接着回收
+        found = OidIsValid(relid);
+    }
+    PG_END_TRY();
+
+    pgstat_report_activity(STATE_IDLE, NULL);
+
+    return found;
+}
+
+void pgsword_reclaim_main(Datum main_arg) {
+    pqsignal(SIGHUP, reclaim_sighup);
+    pqsignal(SIGTERM, reclaim_sigterm);
+
+    BackgroundWorkerUnblockSignals();
+
+    BackgroundWorkerInitializeConnection(pgsword_reclaim_database, NULL);
+
+    // 后台进程自己的 DROP 不能被审核模式拦下
+    SetConfigOption("pgsword.enabled", "off", PGC_SUSET, PGC_S_OVERRIDE);
+
+    while ( !got_sigterm ) {
+        int  rc;
+        long delay = RECLAIM_NAPTIME_MS;
+
+        if ( reclaimOneStep() ) {
+            delay = 1000L;
+        }
+
+        rc = WaitLatch(MyLatch,
+                       WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+                       delay,
+                       PG_WAIT_EXTENSION);
+        ResetLatch(MyLatch);
+
+        if ( rc & WL_POSTMASTER_DEATH ) {
+            proc_exit(1);
+        }
+
+        CHECK_FOR_INTERRUPTS();
+
+        if ( got_sighup ) {
+            got_sighup = false;
+            ProcessConfigFile(PGC_SIGHUP);
+        }
+    }
+
+    proc_exit(0);
+}
@@ -0,0 +1,13 @@
+#ifndef _Qunar_SQL_Audit_RECLAIM_H
+#define _Qunar_SQL_Audit_RECLAIM_H
+
+#include "postgres.h"
+#include "nodes/plannodes.h"
+
+PlannedStmt *deferDropTruncate(PlannedStmt *pstmt);
+int64        relationTotalBytes(Oid relid);
+void         registerReclaimWorker(void);
+
+PGDLLEXPORT void pgsword_reclaim_main(Datum main_arg);
+
+#endif
@@ -11,11 +11,27 @@
 #include "utils/elog.h"
 #include "utils/syscache.h"
 #include "pg_config.h"
-
+#include "access/genam.h"
+#include "access/heapam.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_index.h"
+#include "lib/stringinfo.h"
+#include "parser/parser.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+
+#include "pgsword.h"
 #include "rule.h"
 #include "tools.h"
 
 static bool isValidChar(const char ch);
+static bool indexColsCoverFk(List *idxcols, List *fkattrs);
+static bool indexStmtCoversFk(IndexStmt *idx, const RangeVar *rel, List *fkattrs);
+static bool catalogCoversFk(Oid relid, List *fkattrs);
+static bool scriptCoversFk(const char *queryString, const RangeVar *rel, List *fkattrs);
+static void reportUnindexedFk(const RangeVar *rel, Constraint *con, List *fkattrs);
 
 // 将 timestamp 替换为 timestamptz
 void replaceTimestampToTimestamptz(ColumnDef *colDef) {
@@ -396,3 +412,309 @@ const char *getCreateName(Node *parsetree, NodeTag stmtTag) {
             break;
     }
 }
+
+/*
+ * 外键引用列上的索引
+ *
+ *   引用列上没有索引时，父表每 DELETE 一行或者改一次主键，都要顺序扫描
+ * 一遍子表，还要在子表上加锁，订单表上出过几次锁堆积．
+ *   引用列要被某个索引的前导列覆盖 (顺序无所谓)，索引可以在：
+ *     1. 同一条 CREATE TABLE 里 (PRIMARY KEY, UNIQUE)；
+ *     2. 同一个脚本里还没执行的 CREATE INDEX；
+ *     3. catalog 里已有的索引．
+ *   都没有时给出建议的索引，pgsword.reject_unindexed_fk 打开时直接拒绝．
+ */
+
+/* idxcols: 索引列名 (char *，表达式列为 NULL)，fkattrs: 外键列 (String) */
+static bool indexColsCoverFk(List *idxcols, List *fkattrs) {
+    ListCell *fl;
+    int       nfk = list_length(fkattrs);
+
+    if ( nfk == 0 || list_length(idxcols) < nfk ) {
+        return false;
+    }
+
+    foreach(fl, fkattrs) {
+        const char *fkcol = strVal(lfirst(fl));
+        ListCell   *il;
+        int         i = 0;
+        bool        found = false;
+
+        foreach(il, idxcols) {
+            const char *idxcol = (const char *) lfirst(il);
+
+            if ( i++ >= nfk ) {
+                break;
+            }
+            if ( idxcol != NULL && strcmp(idxcol, fkcol) == 0 ) {
+                found = true;
+                break;
+            }
+        }
+
+        if ( !found ) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool sameRangeVar(const RangeVar *a, const RangeVar *b) {
+    if ( strcmp(a->relname, b->relname) != 0 ) {
+        return false;
+    }
+
+    return a->schemaname == NULL || b->schemaname == NULL
+           || strcmp(a->schemaname, b->schemaname) == 0;
+}
+
+static bool indexStmtCoversFk(IndexStmt *idx, const RangeVar *rel, List *fkattrs) {
+    List     *idxcols = NIL;
+    ListCell *l;
+    bool      covered;
+
+    // 部分索引不一定覆盖要检查的行
+    if ( idx->relation == NULL || idx->whereClause != NULL
+        ||
+         !sameRangeVar(idx->relation, rel) ) {
+        return false;
+    }
+
+    foreach(l, idx->indexParams) {
+        IndexElem *elem = (IndexElem *) lfirst(l);
+
+        idxcols = lappend(idxcols, elem->name);
+    }
+
+    covered = indexColsCoverFk(idxcols, fkattrs);
+    list_free(idxcols);
+
+    return covered;
+}
+
+static bool catalogCoversFk(Oid relid, List *fkattrs) {
+    Relation  rel;
+    List     *indexes;
+    ListCell *l;
+    bool      covered = false;
+
+    rel = heap_open(relid, AccessShareLock);
+    indexes = RelationGetIndexList(rel);
+
+    foreach(l, indexes) {
+        Relation  idxrel = index_open(lfirst_oid(l), AccessShareLock);
+        Form_pg_index idxForm = idxrel->rd_index;
+        List     *idxcols = NIL;
+        int       i;
+
+        if ( IndexIsValid(idxForm) && heap_attisnull(idxrel->rd_indextuple, Anum_pg_index_indpred) ) {
+            for ( i = 0; i < idxForm->indnatts; i++ ) {
+                AttrNumber attnum = idxForm->indkey.values[i];
+
+                idxcols = lappend(idxcols,
+                                  attnum > 0 ? get_attname(relid, attnum) : NULL);
+            }
+            covered = indexColsCoverFk(idxcols, fkattrs);
+            list_free(idxcols);
+        }
+
+        index_close(idxrel, AccessShareLock);
+
+        if ( covered ) {
+            break;
+        }
+    }
+
+    list_free(indexes);
+    heap_close(rel, AccessShareLock);
+
+    return covered;
+}
+
+/*
+ * 脚本里的 CREATE INDEX 语句．
+ *
+ *   一个脚本里每个外键都要查一遍，每次都解析整个脚本是平方级的，
+ * 所以按脚本内容缓存解析出来的 IndexStmt，脚本变了才重新解析．
+ */
+static MemoryContext  scriptIndexContext = NULL;
+static char          *scriptIndexText = NULL;
+static List          *scriptIndexStmts = NIL;
+
+static List *scriptIndexStmtList(const char *queryString) {
+    MemoryContext parseContext;
+    MemoryContext oldcxt;
+    List         *raw;
+    List         *indexes = NIL;
+    ListCell     *l;
+
+    if ( scriptIndexText != NULL && strcmp(scriptIndexText, queryString) == 0 ) {
+        return scriptIndexStmts;
+    }
+
+    if ( scriptIndexContext == NULL ) {
+        scriptIndexContext = AllocSetContextCreate(TopMemoryContext,
+                                                   "pgsword script indexes",
+                                                   ALLOCSET_SMALL_SIZES);
+    }
+    MemoryContextReset(scriptIndexContext);
+    scriptIndexText = NULL;
+    scriptIndexStmts = NIL;
+
+    // 整个解析树用完就丢，只把 IndexStmt 复制到缓存里
+    parseContext = AllocSetContextCreate(CurrentMemoryContext,
+                                         "pgsword script parse",
+                                         ALLOCSET_DEFAULT_SIZES);
+    oldcxt = MemoryContextSwitchTo(parseContext);
+    raw = raw_parser(queryString);
+
+    MemoryContextSwitchTo(scriptIndexContext);
+    foreach(l, raw) {
+        Node *stmt = ((RawStmt *) lfirst(l))->stmt;
+
+        if ( IsA(stmt, IndexStmt) ) {
+            indexes = lappend(indexes, copyObject(stmt));
+        }
+    }
+    scriptIndexText = pstrdup(queryString);
+    scriptIndexStmts = indexes;
+
+    MemoryContextSwitchTo(oldcxt);
+    MemoryContextDelete(parseContext);
+
+    return scriptIndexStmts;
+}
+
+/* 同一个脚本里的 CREATE INDEX，它们在当前语句之后才会执行 */
+static bool scriptCoversFk(const char *queryString, const RangeVar *rel, List *fkattrs) {
+    ListCell *l;
+
+    if ( queryString == NULL ) {
+        return false;
+    }
+
+    foreach(l, scriptIndexStmtList(queryString)) {
+        if ( indexStmtCoversFk((IndexStmt *) lfirst(l), rel, fkattrs) ) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void reportUnindexedFk(const RangeVar *rel, Constraint *con, List *fkattrs) {
+    StringInfoData cols;
+    ListCell      *l;
+
+    initStringInfo(&cols);
+    foreach(l, fkattrs) {
+        appendStringInfo(&cols, "%s%s",
+                         cols.len > 0 ? ", " : "",
+                         quote_identifier(strVal(lfirst(l))));
+    }
+
+    ereport(pgsword_reject_unindexed_fk ? ERROR : WARNING,
+            (errcode(ERRCODE_INTERNAL_ERROR),
+                errmsg("QunarSQLAudit: foreign key (%s) on \"%s\" referencing \"%s\" has no supporting index",
+                       cols.data,
+                       rel->relname,
+                       con->pktable ? con->pktable->relname : "?"),
+                errdetail("every DELETE or key UPDATE on \"%s\" will scan \"%s\"",
+                          con->pktable ? con->pktable->relname : "?",
+                          rel->relname),
+                errhint("CREATE INDEX CONCURRENTLY ON %s (%s);",
+                        quote_qualified_identifier(rel->schemaname, rel->relname),
+                        cols.data)));
+
+    pfree(cols.data);
+}
+
+/* checkForeignKey - 检查一个外键是否有索引支撑，stmts 是同一条语句展开后的列表 */
+void checkForeignKey(const RangeVar *rel, Constraint *con, List *stmts,
+                     const char *queryString) {
+    List     *fkattrs = con->fk_attrs;
+    ListCell *l;
+    Oid       relid;
+
+    if ( con->contype != CONSTR_FOREIGN || fkattrs == NIL ) {
+        return;
+    }
+
+    foreach(l, stmts) {
+        Node *stmt = (Node *) lfirst(l);
+
+        if ( IsA(stmt, IndexStmt)
+            &&
+             indexStmtCoversFk((IndexStmt *) stmt, rel, fkattrs) ) {
+            return;
+        }
+    }
+
+    relid = RangeVarGetRelid(rel, NoLock, true);
+    if ( OidIsValid(relid) && catalogCoversFk(relid, fkattrs) ) {
+        return;
+    }
+
+    if ( scriptCoversFk(queryString, rel, fkattrs) ) {
+        return;
+    }
+
+    reportUnindexedFk(rel, con, fkattrs);
+}
+
+/*
+ * checkCreateForeignKeys - CREATE TABLE 里的外键
+ *
+ *   transformCreateStmt 把列上和表上的外键都填好 fk_attrs，
+ * 放进一条单独的 ALTER TABLE 里．
+ */
+void checkCreateForeignKeys(CreateStmt *stmt, List *stmts, const char *queryString) {
+    ListCell *l;
+
+    foreach(l, stmts) {
+        Node     *node = (Node *) lfirst(l);
+        ListCell *cl;
+
+        if ( !IsA(node, AlterTableStmt) ) {
+            continue;
+        }
+
+        foreach(cl, ((AlterTableStmt *) node)->cmds) {
+            AlterTableCmd *cmd = (AlterTableCmd *) lfirst(cl);
+
+            if ( (cmd->subtype == AT_ProcessedConstraint || cmd->subtype == AT_AddConstraint)
+                &&
+                 IsA(cmd->def, Constraint) ) {
+                checkForeignKey(stmt->relation, (Constraint *) cmd->def, stmts, queryString);
+            }
+        }
+    }
+}
+
+/* checkAlterForeignKeys - ALTER TABLE ADD CONSTRAINT / ADD COLUMN ... REFERENCES */
+void checkAlterForeignKeys(AlterTableStmt *stmt, const char *queryString) {
+    ListCell *l;
+
+    foreach(l, stmt->cmds) {
+        AlterTableCmd *cmd = (AlterTableCmd *) lfirst(l);
+
+        if ( cmd->subtype == AT_AddConstraint && IsA(cmd->def, Constraint) ) {
+            checkForeignKey(stmt->relation, (Constraint *) cmd->def, NIL, queryString);
+        }
+        else if ( cmd->subtype == AT_AddColumn && IsA(cmd->def, ColumnDef) ) {
+            ColumnDef *colDef = (ColumnDef *) cmd->def;
+            ListCell  *cl;
+
+            foreach(cl, colDef->constraints) {
+                Constraint *con = (Constraint *) lfirst(cl);
+
+                if ( con->contype == CONSTR_FOREIGN && con->fk_attrs == NIL ) {
+                    con = copyObject(con);
+                    con->fk_attrs = list_make1(makeString(colDef->colname));
+                }
+                checkForeignKey(stmt->relation, con, NIL, queryString);
+            }
+        }
+    }
+}
@@ -16,5 +16,9 @@ void replaceJsonToJsonb(ColumnDef *colDef);
 void checkRule(CreateStmt *stmt);
 const char *getCreateName(Node *parsetree, NodeTag stmtTag);
 void checkDBObjName(const char *name, NodeTag nodeTag);
+void checkForeignKey(const RangeVar *rel, Constraint *con, List *stmts,
+                     const char *queryString);
+void checkCreateForeignKeys(CreateStmt *stmt, List *stmts, const char *queryString);
+void checkAlterForeignKeys(AlterTableStmt *stmt, const char *queryString);
 
 #endif // _Qunar_PGSQL_Audit_H
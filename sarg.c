@@ -0,0 +1,494 @@
+/* -------------------------------------------------------------------------
+ *
+ * sarg.c
+ *
+ *   WHERE 条件能不能用上索引 (sargability)．
+ *
+ *   每周排查的慢查询里，大部分是明明有索引却用不上：
+ *     1. 索引列外面包了函数或者类型转换：WHERE lower(name) = 'x'
+ *     2. LIKE 以通配符开头：WHERE name LIKE '%x'
+ *     3. OR 连接不同的列，其中一列没有索引，整个 OR 只能顺序扫描
+ *     4. 关联键类型不一致，一边被隐式转换：ON a.id = b.id_text
+ *   post_parse_analyze 时检查 Query 的条件，给出被错过的索引．
+ *
+ *   每张表的索引信息缓存在 backend 本地的 hash 表里，表达式索引的表达式
+ * 也是解析好的节点．relcache 失效时标记为无效，下次用到时重建，热路径上
+ * 不会反复查 catalog，也不会反复 stringToNode()．
+ *
+ * Copyright (c) 2017-2017, Qunar DBA Group
+ *
+ * IDENTIFICATION
+ *      contrib/pgsword/sarg.c
+ *
+ * -------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "access/genam.h"
+#include "access/heapam.h"
+#include "catalog/pg_type.h"
+#include "nodes/nodeFuncs.h"
+#include "nodes/primnodes.h"
+#include "parser/parsetree.h"
+#include "rewrite/rewriteManip.h"
+#include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "utils/relcache.h"
+
+#include "sarg.h"
+
+/* 一个索引的前导列 */
+typedef struct IndexLead {
+    char        name[NAMEDATALEN];
+    AttrNumber  attnum;     /* 0 表示表达式索引 */
+    Node       *expr;       /* 表达式索引的前导表达式 */
+} IndexLead;
+
+typedef struct RelIndexCache {
+    Oid           relid;      /* hash key */
+    bool          valid;
+    uint32        invalCount; /* 失效次数，重建期间失效过就不算有效 */
+    MemoryContext cxt;        /* indexes 和表达式都在这里，重建时整体删掉 */
+    int           nindexes;
+    IndexLead    *indexes;
+} RelIndexCache;
+
+typedef struct SargContext {
+    List       *rtable;
+} SargContext;
+
+static HTAB          *sargCache = NULL;
+static MemoryContext  sargCacheContext = NULL;
+
+static void sargCacheCallback(Datum arg, Oid relid);
+static RelIndexCache *getRelIndexes(Oid relid);
+static const char *leadingIndexOn(Oid relid, AttrNumber attnum);
+static bool exprIndexMatches(Oid relid, Node *expr, Index varno);
+static bool sargWalker(Node *node, SargContext *ctx);
+static void checkQuery(Query *query);
+
+void initSargCache(void) {
+    CacheRegisterRelcacheCallback(sargCacheCallback, (Datum) 0);
+}
+
+/* relcache 失效：只做标记，真正的重建推迟到下一次用到时 */
+static void sargCacheCallback(Datum arg, Oid relid) {
+    HASH_SEQ_STATUS  status;
+    RelIndexCache   *entry;
+
+    if ( sargCache == NULL ) {
+        return;
+    }
+
+    if ( OidIsValid(relid) ) {
+        entry = hash_search(sargCache, &relid, HASH_FIND, NULL);
+        if ( entry != NULL ) {
+            entry->valid = false;
+            entry->invalCount++;
+        }
+        return;
+    }
+
+    hash_seq_init(&status, sargCache);
+    while ( (entry = hash_seq_search(&status)) != NULL ) {
+        entry->valid = false;
+        entry->invalCount++;
+    }
+}
+
+static RelIndexCache *getRelIndexes(Oid relid) {
+    RelIndexCache *entry;
+    bool           found;
+    Relation       rel;
+    List          *indexList;
+    ListCell      *l;
+    uint32         invalCount;
+
+    if ( sargCache == NULL ) {
+        HASHCTL ctl;
+
+        sargCacheContext = AllocSetContextCreate(CacheMemoryContext,
+                                                 "pgsword sargability cache",
+                                                 ALLOCSET_SMALL_SIZES);
+
+        memset(&ctl, 0, sizeof(ctl));
+        ctl.keysize = sizeof(Oid);
+        ctl.entrysize = sizeof(RelIndexCache);
+        ctl.hcxt = sargCacheContext;
+        sargCache = hash_create("pgsword sargability cache", 64, &ctl,
+                                HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+    }
+
+    entry = hash_search(sargCache, &relid, HASH_ENTER, &found);
+    if ( !found ) {
+        entry->invalCount = 0;
+        entry->cxt = NULL;
+    }
+    else if ( entry->valid ) {
+        return entry;
+    }
+
+    if ( entry->cxt != NULL ) {
+        MemoryContextDelete(entry->cxt);
+    }
+    entry->cxt = AllocSetContextCreate(sargCacheContext,
+                                       "pgsword sargability entry",
+                                       ALLOCSET_SMALL_SIZES);
+    entry->indexes = NULL;
+    entry->nindexes = 0;
+    entry->valid = false;
+
+    // 下面打开索引时可能处理失效消息，这期间失效过的话结果不能算有效
+    invalCount = entry->invalCount;
+
+    // 解析阶段已经对查询用到的表加了锁
+    rel = heap_open(relid, NoLock);
+    indexList = RelationGetIndexList(rel);
+
+    entry->indexes = MemoryContextAllocZero(entry->cxt,
+                                            sizeof(IndexLead) * Max(list_length(indexList), 1));
+
+    foreach(l, indexList) {
+        Relation   idxrel = index_open(lfirst_oid(l), AccessShareLock);
+        IndexLead *lead = &entry->indexes[entry->nindexes];
+
+        // 部分索引和还没建好的索引不算
+        if ( IndexIsValid(idxrel->rd_index)
+            &&
+             RelationGetIndexPredicate(idxrel) == NIL ) {
+            strlcpy(lead->name, RelationGetRelationName(idxrel), NAMEDATALEN);
+            lead->attnum = idxrel->rd_index->indkey.values[0];
+            if ( lead->attnum == 0 ) {
+                List         *exprs = RelationGetIndexExpressions(idxrel);
+                MemoryContext oldcxt = MemoryContextSwitchTo(entry->cxt);
+
+                lead->expr = copyObject(linitial(exprs));
+                MemoryContextSwitchTo(oldcxt);
+            }
+            entry->nindexes++;
+        }
+
+        index_close(idxrel, AccessShareLock);
+    }
+
+    list_free(indexList);
+    heap_close(rel, NoLock);
+
+    // 这次用重建的结果，失效过的话下次用到时再重建
+    entry->valid = entry->invalCount == invalCount;
+
+    return entry;
+}
+
+/* 以 attnum 为前导列的索引名，没有返回 NULL */
+static const char *leadingIndexOn(Oid relid, AttrNumber attnum) {
+    RelIndexCache *entry = getRelIndexes(relid);
+    int            i;
+
+    for ( i = 0; i < entry->nindexes; i++ ) {
+        if ( entry->indexes[i].attnum == attnum ) {
+            return entry->indexes[i].name;
+        }
+    }
+
+    return NULL;
+}
+
+/* 是否有表达式索引正好是这个表达式 */
+static bool exprIndexMatches(Oid relid, Node *expr, Index varno) {
+    RelIndexCache *entry = getRelIndexes(relid);
+    int            i;
+
+    for ( i = 0; i < entry->nindexes; i++ ) {
+        Node *idxexpr;
+
+        if ( entry->indexes[i].expr == NULL ) {
+            continue;
+        }
+
+        // 索引表达式里的 Var 的 varno 都是 1，ChangeVarNodes() 会改节点，先复制
+        idxexpr = entry->indexes[i].expr;
+        if ( varno != 1 ) {
+            idxexpr = copyObject(idxexpr);
+            ChangeVarNodes(idxexpr, 1, varno, 0);
+        }
+        if ( equal(idxexpr, expr) ) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* 是不是类型转换：::type，CAST()，或者隐式转换 */
+static bool isCastExpr(Node *node) {
+    if ( IsA(node, RelabelType) || IsA(node, CoerceViaIO) ) {
+        return true;
+    }
+
+    if ( IsA(node, FuncExpr) ) {
+        CoercionForm format = ((FuncExpr *) node)->funcformat;
+
+        return format == COERCE_EXPLICIT_CAST || format == COERCE_IMPLICIT_CAST;
+    }
+
+    return false;
+}
+
+/* 去掉不影响用索引的二进制兼容转换，比如 varchar -> text */
+static Node *stripRelabel(Node *node) {
+    while ( node && IsA(node, RelabelType) ) {
+        node = (Node *) ((RelabelType *) node)->arg;
+    }
+    return node;
+}
+
+typedef struct VarCount {
+    int   nvars;
+    Var  *var;
+} VarCount;
+
+/* 数本层的 Var，子查询里的不算 */
+static bool countVarsWalker(Node *node, VarCount *vc) {
+    if ( node == NULL ) {
+        return false;
+    }
+
+    if ( IsA(node, Var) ) {
+        if ( ((Var *) node)->varlevelsup == 0 ) {
+            vc->nvars++;
+            vc->var = (Var *) node;
+        }
+        return false;
+    }
+
+    if ( IsA(node, Query) ) {
+        return false;
+    }
+
+    return expression_tree_walker(node, countVarsWalker, (void *) vc);
+}
+
+/* 表达式里唯一的一个本层 Var，并且它来自一张普通表 */
+static Var *singleTableVar(Node *node, SargContext *ctx, Oid *relid) {
+    VarCount       vc = { 0, NULL };
+    Var           *var;
+    RangeTblEntry *rte;
+
+    countVarsWalker(node, &vc);
+    if ( vc.nvars != 1 ) {
+        return NULL;
+    }
+
+    var = vc.var;
+    if ( var->varattno <= 0 ) {
+        return NULL;
+    }
+
+    rte = rt_fetch(var->varno, ctx->rtable);
+    if ( rte->rtekind != RTE_RELATION ) {
+        return NULL;
+    }
+
+    *relid = rte->relid;
+
+    return var;
+}
+
+static void reportMissedIndex(Oid relid, Var *var, const char *idxname, const char *why) {
+    ereport(WARNING,
+            (errmsg("QunarSQLAudit: index \"%s\" on \"%s\".\"%s\" cannot be used: %s",
+                    idxname,
+                    get_rel_name(relid),
+                    get_attname(relid, var->varattno),
+                    why)));
+}
+
+static void checkOpExpr(OpExpr *op, SargContext *ctx) {
+    int i;
+
+    if ( list_length(op->args) != 2 ) {
+        return;
+    }
+
+    for ( i = 0; i < 2; i++ ) {
+        Node       *arg = stripRelabel((Node *) list_nth(op->args, i));
+        Node       *other = stripRelabel((Node *) list_nth(op->args, 1 - i));
+        Var        *var;
+        Oid         relid;
+        const char *idxname;
+
+        var = singleTableVar(arg, ctx, &relid);
+        if ( var == NULL ) {
+            continue;
+        }
+
+        idxname = leadingIndexOn(relid, var->varattno);
+        if ( idxname == NULL ) {
+            continue;
+        }
+
+        if ( IsA(arg, Var) ) {
+            char *opname = get_opname(op->opno);
+
+            // LIKE '%xxx' / LIKE '_xxx'
+            if ( i == 0 && opname != NULL
+                &&
+                 (strcmp(opname, "~~") == 0 || strcmp(opname, "~~*") == 0)
+                &&
+                 IsA(other, Const)
+                &&
+                 !((Const *) other)->constisnull
+                &&
+                 (((Const *) other)->consttype == TEXTOID ||
+                  ((Const *) other)->consttype == VARCHAROID ||
+                  ((Const *) other)->consttype == BPCHAROID) ) {
+                char *pattern = TextDatumGetCString(((Const *) other)->constvalue);
+
+                if ( pattern[0] == '%' || pattern[0] == '_' ) {
+                    reportMissedIndex(relid, var, idxname,
+                                      "LIKE pattern starts with a wildcard");
+                }
+            }
+            continue;
+        }
+
+        if ( exprIndexMatches(relid, arg, var->varno) ) {
+            continue;
+        }
+
+        if ( IsA(arg, FuncExpr)
+            &&
+             ((FuncExpr *) arg)->funcformat == COERCE_IMPLICIT_CAST
+            &&
+             IsA(other, Var) ) {
+            reportMissedIndex(relid, var, idxname,
+                              "join key is implicitly cast to another type, "
+                              "make both sides the same type");
+        }
+        else if ( IsA(arg, FuncExpr) && ((FuncExpr *) arg)->funcformat == COERCE_EXPLICIT_CALL ) {
+            reportMissedIndex(relid, var, idxname,
+                              "the column is wrapped in a function, "
+                              "rewrite the predicate or create an expression index");
+        }
+        else if ( isCastExpr(arg) ) {
+            reportMissedIndex(relid, var, idxname,
+                              "the column is cast to another type, "
+                              "cast the other side instead");
+        }
+        else {
+            reportMissedIndex(relid, var, idxname,
+                              "the predicate is an expression on the indexed column, "
+                              "rewrite it to compare the bare column");
+        }
+    }
+}
+
+/*
+ * OR 的各个分支用到不同的列时，只要有一个分支的列没有索引，
+ * 整个 OR 就只能顺序扫描，其它分支上的索引也白建了．
+ */
+static void checkOrExpr(BoolExpr *expr, SargContext *ctx) {
+    ListCell   *l;
+    Var        *indexedVar = NULL;
+    Oid         indexedRel = InvalidOid;
+    const char *idxname = NULL;
+    Var        *plainVar = NULL;
+    Oid         plainRel = InvalidOid;
+
+    foreach(l, expr->args) {
+        Var  *var;
+        Oid   relid;
+        const char *name;
+
+        var = singleTableVar((Node *) lfirst(l), ctx, &relid);
+        if ( var == NULL ) {
+            return;
+        }
+
+        name = leadingIndexOn(relid, var->varattno);
+        if ( name != NULL && indexedVar == NULL ) {
+            indexedVar = var;
+            indexedRel = relid;
+            idxname = name;
+        }
+        else if ( name == NULL && plainVar == NULL ) {
+            plainVar = var;
+            plainRel = relid;
+        }
+    }
+
+    if ( indexedVar != NULL && plainVar != NULL ) {
+        char why[NAMEDATALEN * 3];
+
+        snprintf(why, sizeof(why),
+                 "OR with \"%s\".\"%s\" which has no index, "
+                 "rewrite as UNION ALL or index that column",
+                 get_rel_name(plainRel),
+                 get_attname(plainRel, plainVar->varattno));
+        reportMissedIndex(indexedRel, indexedVar, idxname, why);
+    }
+}
+
+static bool sargWalker(Node *node, SargContext *ctx) {
+    if ( node == NULL ) {
+        return false;
+    }
+
+    if ( IsA(node, OpExpr) ) {
+        checkOpExpr((OpExpr *) node, ctx);
+    }
+    else if ( IsA(node, BoolExpr) && ((BoolExpr *) node)->boolop == OR_EXPR ) {
+        checkOrExpr((BoolExpr *) node, ctx);
+    }
+    else if ( IsA(node, Query) ) {
+        // 子查询有自己的 range table
+        checkQuery((Query *) node);
+        return false;
+    }
+
+    return expression_tree_walker(node, sargWalker, (void *) ctx);
+}
+
+static void checkQuery(Query *query) {
+    SargContext ctx;
+    ListCell   *l;
+
+    ctx.rtable = query->rtable;
+
+    // 只看 WHERE 和 JOIN ON，目标列上的函数不影响用索引
+    sargWalker((Node *) query->jointree, &ctx);
+
+    foreach(l, query->rtable) {
+        RangeTblEntry *rte = (RangeTblEntry *) lfirst(l);
+
+        if ( rte->rtekind == RTE_SUBQUERY ) {
+            checkQuery(rte->subquery);
+        }
+    }
+
+    foreach(l, query->cteList) {
+        CommonTableExpr *cte = (CommonTableExpr *) lfirst(l);
+
+        if ( IsA(cte->ctequery, Query) ) {
+            checkQuery((Query *) cte->ctequery);
+        }
+    }
+}
+
+/* checkSargability - post_parse_analyze 时检查一个查询 */
+void checkSargability(Query *query) {
+    if ( query->commandType != CMD_SELECT
+        &&
+         query->commandType != CMD_UPDATE
+        &&
+         query->commandType != CMD_DELETE ) {
+        return;
+    }
+
+    checkQuery(query);
+}
@@ -0,0 +1,10 @@
+#ifndef _Qunar_SQL_Audit_SARG_H
+#define _Qunar_SQL_Audit_SARG_H
+
+#include "postgres.h"
+#include "nodes/parsenodes.h"
+
+void initSargCache(void);
+void checkSargability(Query *query);
+
+#endif
@@ -28,9 +28,157 @@ int isKeyword(const char *str) {
     return 0;
 }
 
+/* "table:N" 里的 N，必须是完整的非负整数 */
+static bool parseRowLimit(const char *str, int64 *limit) {
+    char *end;
+
+    if ( *str == '\0' ) {
+        return false;
+    }
+
+    errno = 0;
+    *limit = strtoll(str, &end, 10);
+
+    return errno == 0 && *end == '\0' && *limit >= 0;
+}
+
+/*
+ * tableRowLimitsValid - 检查 "schema.table:N, table:N" 格式的配置，
+ * 给 pgsword.table_max_rows_modified 的 check_hook 用．
+ *
+ *   不合法时 *badItem 返回第一个不合法的条目．
+ */
+bool tableRowLimitsValid(const char *conf, char **badItem) {
+    char     *rawstring;
+    char     *item;
+    char     *saveptr = NULL;
+    bool      valid = true;
+
+    if ( conf == NULL || conf[0] == '\0' ) {
+        return true;
+    }
+
+    rawstring = pstrdup(conf);
+
+    for ( item = strtok_r(rawstring, ", ", &saveptr);
+          item != NULL && valid;
+          item = strtok_r(NULL, ", ", &saveptr) ) {
+        char  *colon = strrchr(item, ':');
+        int64  limit;
+
+        valid = colon != NULL && colon != item && colon[-1] != '.' && item[0] != '.'
+                && parseRowLimit(colon + 1, &limit);
+        if ( !valid ) {
+            *badItem = pstrdup(item);
+        }
+    }
+
+    pfree(rawstring);
+
+    return valid;
+}
+
+/*
+ * lookupTableRowLimit - 从 "schema.table:N, table:N" 格式的配置中
+ * 找出某张表的限制．
+ *
+ *   和 tableInList() 一样按 ", " 切分条目．
+ *   不带 schema 的条目匹配任意 schema，带 schema 的条目优先．
+ *   找不到返回 -1，表示不限．配置已经由 check_hook 检查过．
+ *   配置只在语句开始时解析一次，不在每行的路径上．
+ */
+int64 lookupTableRowLimit(const char *conf, const char *nspname, const char *relname) {
+    char     *rawstring;
+    char     *item;
+    char     *saveptr = NULL;
+    int64     limit = -1;
+    bool      schemaMatched = false;
+
+    if ( conf == NULL || conf[0] == '\0' || relname == NULL ) {
+        return -1;
+    }
+
+    rawstring = pstrdup(conf);
+
+    for ( item = strtok_r(rawstring, ", ", &saveptr);
+          item != NULL;
+          item = strtok_r(NULL, ", ", &saveptr) ) {
+        char  *colon = strrchr(item, ':');
+        char  *dot;
+        char  *tabname;
+        int64  itemLimit;
+
+        if ( colon == NULL || !parseRowLimit(colon + 1, &itemLimit) ) {
+            continue;
+        }
+        *colon = '\0';
+        tabname = item;
+
+        dot = strchr(item, '.');
+        if ( dot != NULL ) {
+            *dot = '\0';
+            tabname = dot + 1;
+            if ( nspname == NULL || strcmp(item, nspname) != 0 ) {
+                continue;
+            }
+        }
+        else if ( schemaMatched ) {
+            continue;
+        }
+
+        if ( strcmp(tabname, relname) == 0 ) {
+            limit = itemLimit;
+            schemaMatched = (dot != NULL);
+        }
+    }
+
+    pfree(rawstring);
+
+    return limit;
+}
+
+/*
+ * tableInList - 表是否出现在 "schema.table, table" 格式的配置中
+ *
+ *   不带 schema 的条目匹配任意 schema．
+ */
+bool tableInList(const char *conf, const char *nspname, const char *relname) {
+    char     *rawstring;
+    char     *item;
+    char     *saveptr = NULL;
+    bool      found = false;
+
+    if ( conf == NULL || conf[0] == '\0' || relname == NULL ) {
+        return false;
+    }
+
+    rawstring = pstrdup(conf);
+
+    for ( item = strtok_r(rawstring, ", ", &saveptr);
+          item != NULL && !found;
+          item = strtok_r(NULL, ", ", &saveptr) ) {
+        char *dot = strchr(item, '.');
+
+        if ( dot == NULL ) {
+            found = strcmp(item, relname) == 0;
+        }
+        else {
+            *dot = '\0';
+            found = nspname != NULL
+                    && strcmp(item, nspname) == 0
+                    && strcmp(dot + 1, relname) == 0;
+        }
+    }
+
+    pfree(rawstring);
+
+    return found;
+}
+
 void initConstrList(ConstrList *clist) {
     clist->is_primary_key = false;
     clist->is_unique   = false;
+    clist->is_foreign_key = false;
     clist->is_not_null = false;
     clist->has_default = false;
     clist->default_str = NULL;
@@ -50,6 +198,9 @@ void getConstrList(ConstrList *cListStruct, List *cons) {
             case CONSTR_UNIQUE:
                 cListStruct->is_unique = true;
                 break;
+            case CONSTR_FOREIGN:
+                cListStruct->is_foreign_key = true;
+                break;
             case CONSTR_NOTNULL:
                 cListStruct->is_not_null = true;
                 break;
@@ -104,7 +255,7 @@ void finishAudit() {
     char mymsg[512] = { 0 };
 
     snprintf(mymsg, 512, "\b\b\b\b\b\b\b\b%s",
-             "QunarPGSQLAudit:  AUDIT OK");
+             AUDIT_OK_MSG);
 
     ereport(ERROR,
                 (errcode(ERRCODE_INTERNAL_ERROR),
@@ -277,13 +428,14 @@ void dispCreateStmt(CreateStmt *stmt) {
 
         msgNBytes = snprintf(msg + msg_pos,
                                 1024 - msg_pos,
-                                "colname \"%s\", typname \"%s\", typoid %d %s %s %s %s\n         ",
+                                "colname \"%s\", typname \"%s\", typoid %d %s %s %s %s %s\n         ",
                                 colDef->colname,
                                 typname == NULL ? "unkown" : typname,
                                 atttypid,
                                 constrList.is_primary_key ? "PRIMARY KEY" : "",
                                 constrList.is_unique ? "UNIQUE" : "",
                                 constrList.is_not_null ? "NOT NULL" : "",
+                                constrList.is_foreign_key ? "REFERENCES" : "",
                                 constrList.has_default ? default_info : "");
 
         msg_pos += msgNBytes;
@@ -5,10 +5,14 @@
 
 #define MYMSG_SIZE 256
 
+/* finishAudit() 报错的消息，审核通过的标志 */
+#define AUDIT_OK_MSG "QunarPGSQLAudit:  AUDIT OK"
+
 typedef struct ConstrList {
     bool   is_not_null;
     bool   is_primary_key;
     bool   is_unique;
+    bool   is_foreign_key;
     bool   has_default;
     char  *default_str;
 } ConstrList;
@@ -27,5 +31,8 @@ void     disp_VariableSetStmt(VariableSetStmt *stmt, char *mymsg);
 void     dispCreateStmt(CreateStmt *stmt);
 void     dispStmt(PlannedStmt *pstmt);
 int      isKeyword(const char *str);
+bool     tableRowLimitsValid(const char *conf, char **badItem);
+int64    lookupTableRowLimit(const char *conf, const char *nspname, const char *relname);
+bool     tableInList(const char *conf, const char *nspname, const char *relname);
 
 #endif
@@ -0,0 +1,673 @@
+/* -------------------------------------------------------------------------
+ *
+ * volatility.c
+ *
+ *   CREATE FUNCTION 的 volatility，PARALLEL 标记和内联审核．
+ *
+ *   函数默认是 VOLATILE PARALLEL UNSAFE，开发很少改它．后果是：
+ *     - 不能用在表达式索引里，也不能作为索引扫描的比较值；
+ *     - 每一行都要重新调用，不能在计划时折叠成常量；
+ *     - SQL 函数不能被内联，调用它的查询也不能并行．
+ *   这里分析函数体里调用的函数和访问的表，推导出最严格的正确标记，
+ * 和声明的标记比较：
+ *     - 声明的比推导的宽松，给出建议；
+ *     - 声明的比推导的严格 (例如读表的函数声明为 IMMUTABLE)，结果可能出错．
+ *   打开 pgsword.enforce_function_volatility 后，两种情况都拒绝．
+ *
+ *   LANGUAGE sql 的函数体做完整的语义分析；LANGUAGE plpgsql 的函数体
+ * 只按词法扫描函数调用和 SQL 关键字，结果不一定准确，只给出警告，
+ * 不受 pgsword.enforce_function_volatility 影响．其它语言不分析．
+ *
+ * Copyright (c) 2017-2017, Qunar DBA Group
+ *
+ * IDENTIFICATION
+ *      contrib/pgsword/volatility.c
+ *
+ * -------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "access/xact.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_proc.h"
+#include "catalog/pg_type.h"
+#include "common/keywords.h"
+#include "executor/functions.h"
+#include "nodes/nodeFuncs.h"
+#include "optimizer/clauses.h"
+#include "parser/gram.h"
+#include "parser/parse_type.h"
+#include "parser/scanner.h"
+#include "tcop/tcopprot.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/resowner.h"
+
+#include "pgsword.h"
+#include "volatility.h"
+
+/* 函数体分析的结果 */
+typedef struct FuncBodyInfo {
+    char    volatility;     /* 推导出的最严格的 volatility */
+    char   *volatileWhy;    /* 为什么不能更严格 */
+    char    parallel;       /* 推导出的最严格的 PARALLEL 标记 */
+    char   *parallelWhy;
+    List   *noInline;       /* 不能内联的原因 (char *) */
+    bool    opaque;         /* 有动态 SQL，无法分析 */
+    bool    advisory;       /* 只是词法上的推测，不据此拒绝 */
+} FuncBodyInfo;
+
+/* 声明的属性 */
+typedef struct FuncDecl {
+    char   *name;
+    char   *language;
+    char   *body;
+    char    volatility;
+    char    parallel;
+    bool    strict;
+    bool    secdef;
+    bool    hasSet;
+    bool    retset;
+    bool    isTrigger;
+} FuncDecl;
+
+static const char *volatilityName(char v) {
+    switch ( v ) {
+        case PROVOLATILE_IMMUTABLE: return "IMMUTABLE";
+        case PROVOLATILE_STABLE:    return "STABLE";
+        default:                    return "VOLATILE";
+    }
+}
+
+static const char *parallelName(char p) {
+    switch ( p ) {
+        case PROPARALLEL_SAFE:       return "PARALLEL SAFE";
+        case PROPARALLEL_RESTRICTED: return "PARALLEL RESTRICTED";
+        default:                     return "PARALLEL UNSAFE";
+    }
+}
+
+/* IMMUTABLE < STABLE < VOLATILE 正好是字符顺序，PARALLEL 的不是 */
+static int parallelRank(char p) {
+    switch ( p ) {
+        case PROPARALLEL_SAFE:       return 0;
+        case PROPARALLEL_RESTRICTED: return 1;
+        default:                     return 2;
+    }
+}
+
+static void noteVolatility(FuncBodyInfo *info, char v, char *why) {
+    if ( v > info->volatility ) {
+        info->volatility = v;
+        info->volatileWhy = why;
+    }
+}
+
+static void noteParallel(FuncBodyInfo *info, char p, char *why) {
+    if ( parallelRank(p) > parallelRank(info->parallel) ) {
+        info->parallel = p;
+        info->parallelWhy = why;
+    }
+}
+
+static void noteFunction(FuncBodyInfo *info, Oid funcid) {
+    char  v = func_volatile(funcid);
+    char  p = func_parallel(funcid);
+
+    if ( v > info->volatility ) {
+        noteVolatility(info, v,
+                       psprintf("calls %s function %s()", volatilityName(v), get_func_name(funcid)));
+    }
+    if ( parallelRank(p) > parallelRank(info->parallel) ) {
+        noteParallel(info, p,
+                     psprintf("calls %s function %s()", parallelName(p), get_func_name(funcid)));
+    }
+}
+
+/* ---------------------------------------------------------------------- */
+/* LANGUAGE sql                                                           */
+/* ---------------------------------------------------------------------- */
+
+static bool funcChecker(Oid funcid, void *context) {
+    noteFunction((FuncBodyInfo *) context, funcid);
+    return false;
+}
+
+static bool sqlBodyWalker(Node *node, FuncBodyInfo *info) {
+    if ( node == NULL ) {
+        return false;
+    }
+
+    if ( IsA(node, RangeTblEntry) ) {
+        RangeTblEntry *rte = (RangeTblEntry *) node;
+
+        if ( rte->rtekind == RTE_RELATION ) {
+            noteVolatility(info, PROVOLATILE_STABLE,
+                           psprintf("reads table %s", get_rel_name(rte->relid)));
+            if ( get_rel_persistence(rte->relid) == RELPERSISTENCE_TEMP ) {
+                noteParallel(info, PROPARALLEL_RESTRICTED,
+                             psprintf("reads temporary table %s", get_rel_name(rte->relid)));
+            }
+        }
+        return false;
+    }
+
+    // CURRENT_TIMESTAMP，CURRENT_USER，LOCALTIME 等在一个事务/语句内不变
+    if ( IsA(node, SQLValueFunction) ) {
+        noteVolatility(info, PROVOLATILE_STABLE,
+                       "uses CURRENT_TIMESTAMP, CURRENT_USER or a similar SQL value function");
+    }
+
+    if ( IsA(node, NextValueExpr) ) {
+        noteVolatility(info, PROVOLATILE_VOLATILE, "uses an identity column sequence");
+        noteParallel(info, PROPARALLEL_UNSAFE, "uses an identity column sequence");
+    }
+
+    if ( IsA(node, Query) ) {
+        Query *q = (Query *) node;
+
+        if ( q->commandType != CMD_SELECT || q->utilityStmt != NULL ) {
+            noteVolatility(info, PROVOLATILE_VOLATILE, "modifies data");
+            noteParallel(info, PROPARALLEL_UNSAFE, "modifies data");
+        }
+        else if ( q->rowMarks != NIL ) {
+            noteVolatility(info, PROVOLATILE_VOLATILE, "locks rows with FOR UPDATE/SHARE");
+            noteParallel(info, PROPARALLEL_UNSAFE, "locks rows with FOR UPDATE/SHARE");
+        }
+
+        return query_tree_walker(q, sqlBodyWalker, (void *) info, QTW_EXAMINE_RTES);
+    }
+
+    check_functions_in_node(node, funcChecker, (void *) info);
+
+    return expression_tree_walker(node, sqlBodyWalker, (void *) info);
+}
+
+/* inline_function() 和 inline_set_returning_function() 的条件 */
+static void checkSqlInlining(FuncDecl *decl, List *queries, FuncBodyInfo *info) {
+    Query *q;
+
+    if ( decl->secdef ) {
+        info->noInline = lappend(info->noInline, "it is SECURITY DEFINER");
+    }
+    if ( decl->hasSet ) {
+        info->noInline = lappend(info->noInline, "it has SET clauses");
+    }
+    if ( list_length(queries) != 1 ) {
+        info->noInline = lappend(info->noInline, "its body is not a single statement");
+        return;
+    }
+
+    q = (Query *) linitial(queries);
+    if ( q->commandType != CMD_SELECT || q->utilityStmt != NULL ) {
+        info->noInline = lappend(info->noInline, "its body is not a SELECT");
+        return;
+    }
+
+    if ( decl->retset ) {
+        // 只有在 FROM 里调用的 SETOF 函数才会内联
+        if ( decl->volatility == PROVOLATILE_VOLATILE ) {
+            info->noInline = lappend(info->noInline, "set-returning functions declared VOLATILE are never inlined");
+        }
+        if ( decl->strict ) {
+            info->noInline = lappend(info->noInline, "set-returning functions declared STRICT are never inlined");
+        }
+        return;
+    }
+
+    if ( q->rtable != NIL || q->jointree->fromlist != NIL || q->jointree->quals != NULL
+        || q->hasAggs || q->hasWindowFuncs || q->hasTargetSRFs || q->hasSubLinks
+        || q->cteList != NIL || q->groupClause != NIL || q->havingQual != NULL
+        || q->distinctClause != NIL || q->sortClause != NIL
+        || q->limitCount != NULL || q->limitOffset != NULL
+        || q->setOperations != NULL || list_length(q->targetList) != 1 ) {
+        info->noInline = lappend(info->noInline,
+                                 "only a single-expression SELECT without FROM is inlined; "
+                                 "consider RETURNS SETOF/TABLE and calling it in FROM");
+        return;
+    }
+
+    if ( decl->volatility == PROVOLATILE_IMMUTABLE
+        && contain_mutable_functions((Node *) q->targetList) ) {
+        info->noInline = lappend(info->noInline, "it is declared IMMUTABLE but its expression is not");
+    }
+    else if ( decl->volatility == PROVOLATILE_STABLE
+             && contain_volatile_functions((Node *) q->targetList) ) {
+        info->noInline = lappend(info->noInline, "it is declared STABLE but its expression is VOLATILE");
+    }
+
+    if ( decl->strict && contain_nonstrict_functions((Node *) q->targetList) ) {
+        info->noInline = lappend(info->noInline, "it is STRICT but its expression contains non-strict functions");
+    }
+}
+
+static void analyzeSqlBody(FuncDecl *decl, CreateFunctionStmt *stmt, FuncBodyInfo *info) {
+    SQLFunctionParseInfoPtr pinfo;
+    List     *raw;
+    List     *queries = NIL;
+    ListCell *lc;
+    int       nargs = 0;
+
+    pinfo = (SQLFunctionParseInfoPtr) palloc0(sizeof(SQLFunctionParseInfo));
+    pinfo->fname = decl->name;
+    pinfo->argtypes = (Oid *) palloc0(sizeof(Oid) * (list_length(stmt->parameters) + 1));
+    pinfo->argnames = (char **) palloc0(sizeof(char *) * (list_length(stmt->parameters) + 1));
+    pinfo->collation = InvalidOid;
+
+    foreach(lc, stmt->parameters) {
+        FunctionParameter *p = (FunctionParameter *) lfirst(lc);
+
+        if ( p->mode == FUNC_PARAM_OUT || p->mode == FUNC_PARAM_TABLE ) {
+            continue;
+        }
+        pinfo->argtypes[nargs] = LookupTypeNameOid(NULL, p->argType, false);
+        pinfo->argnames[nargs] = p->name;
+        nargs++;
+    }
+    pinfo->nargs = nargs;
+
+    raw = pg_parse_query(decl->body);
+
+    foreach(lc, raw) {
+        queries = list_concat(queries,
+                              pg_analyze_and_rewrite_params((RawStmt *) lfirst(lc), decl->body,
+                                                            (ParserSetupHook) sql_fn_parser_setup,
+                                                            pinfo, NULL));
+    }
+
+    foreach(lc, queries) {
+        sqlBodyWalker((Node *) lfirst(lc), info);
+    }
+
+    checkSqlInlining(decl, queries, info);
+}
+
+/* ---------------------------------------------------------------------- */
+/* LANGUAGE plpgsql                                                       */
+/* ---------------------------------------------------------------------- */
+
+#define MAX_PAREN_DEPTH 64
+
+/*
+ * PL/pgSQL 的语法不是 SQL，没法直接做语义分析．
+ * 这里用核心的词法分析器扫描函数体：
+ *     - "名字(" 当作函数调用，按名字查所有重载，取最宽松的标记；
+ *     - FROM 当作读表 (EXTRACT/SUBSTRING 等括号里的 FROM 和
+ *       IS DISTINCT FROM 除外)；
+ *     - CURRENT_TIMESTAMP，CURRENT_USER 等 SQL 值函数是 STABLE；
+ *     - INSERT/UPDATE/DELETE/COPY 当作修改数据；
+ *     - EXECUTE 是动态 SQL，无法分析，不再比较标记．
+ */
+static void analyzePlpgsqlBody(FuncDecl *decl, FuncBodyInfo *info) {
+    core_yyscan_t      yyscanner;
+    core_yy_extra_type yyextra;
+    core_YYSTYPE       yylval;
+    YYLTYPE            yylloc;
+    bool               parenIsFunc[MAX_PAREN_DEPTH];
+    int                depth = 0;
+    int                lastTok = 0;
+    int                ntokens = 0;
+    int                nsemicolons = 0;
+    bool               simpleReturn = false;
+    List              *name = NIL;
+
+    yyscanner = scanner_init(decl->body, &yyextra, ScanKeywords, NumScanKeywords);
+
+    for ( ;; ) {
+        int tok = core_yylex(&yylval, &yylloc, yyscanner);
+
+        if ( tok == 0 ) {
+            break;
+        }
+        ntokens++;
+
+        // BEGIN RETURN <expr>; END; 这种函数体可以改写成 LANGUAGE sql
+        if ( ntokens == 2 ) {
+            simpleReturn = lastTok == BEGIN_P && tok == IDENT && strcmp(yylval.str, "return") == 0;
+        }
+
+        switch ( tok ) {
+            case IDENT:
+                if ( lastTok == '.' && name != NIL ) {
+                    name = lappend(name, makeString(yylval.str));
+                }
+                else {
+                    name = list_make1(makeString(yylval.str));
+                }
+                break;
+
+            case '.':
+                break;
+
+            case '(':
+                if ( lastTok == IDENT && name != NIL ) {
+                    FuncCandidateList clist;
+
+                    clist = FuncnameGetCandidates(name, -1, NIL, false, false, true);
+                    for ( ; clist != NULL; clist = clist->next ) {
+                        noteFunction(info, clist->oid);
+                    }
+                }
+                if ( depth < MAX_PAREN_DEPTH ) {
+                    parenIsFunc[depth] = lastTok == EXTRACT || lastTok == SUBSTRING
+                                        || lastTok == TRIM || lastTok == OVERLAY
+                                        || lastTok == POSITION;
+                }
+                depth++;
+                name = NIL;
+                break;
+
+            case ')':
+                if ( depth > 0 ) {
+                    depth--;
+                }
+                name = NIL;
+                break;
+
+            case ';':
+                nsemicolons++;
+                name = NIL;
+                break;
+
+            case CURRENT_DATE:
+            case CURRENT_TIME:
+            case CURRENT_TIMESTAMP:
+            case LOCALTIME:
+            case LOCALTIMESTAMP:
+            case CURRENT_ROLE:
+            case CURRENT_USER:
+            case SESSION_USER:
+            case USER:
+            case CURRENT_CATALOG:
+            case CURRENT_SCHEMA:
+                noteVolatility(info, PROVOLATILE_STABLE,
+                               "uses CURRENT_TIMESTAMP, CURRENT_USER or a similar SQL value function");
+                name = NIL;
+                break;
+
+            case FROM:
+                // IS [NOT] DISTINCT FROM 不是读表
+                if ( lastTok != DISTINCT
+                    &&
+                     (depth == 0 || depth > MAX_PAREN_DEPTH || !parenIsFunc[depth - 1]) ) {
+                    noteVolatility(info, PROVOLATILE_STABLE, "reads tables");
+                }
+                name = NIL;
+                break;
+
+            case INSERT:
+            case UPDATE:
+            case DELETE_P:
+            case COPY:
+                noteVolatility(info, PROVOLATILE_VOLATILE, "modifies data");
+                noteParallel(info, PROPARALLEL_UNSAFE, "modifies data");
+                name = NIL;
+                break;
+
+            case EXECUTE:
+                info->opaque = true;
+                name = NIL;
+                break;
+
+            default:
+                name = NIL;
+                break;
+        }
+
+        lastTok = tok;
+    }
+
+    scanner_finish(yyscanner);
+
+    info->noInline = lappend(info->noInline, "PL/pgSQL functions are never inlined");
+    if ( simpleReturn && nsemicolons <= 2 && !decl->retset ) {
+        info->noInline = lappend(info->noInline,
+                                 "its body is a single RETURN expression, rewrite it as LANGUAGE sql");
+    }
+}
+
+/* ---------------------------------------------------------------------- */
+
+static void parseDecl(CreateFunctionStmt *stmt, FuncDecl *decl) {
+    ListCell *lc;
+
+    memset(decl, 0, sizeof(FuncDecl));
+    decl->name = NameListToString(stmt->funcname);
+    decl->volatility = PROVOLATILE_VOLATILE;
+    decl->parallel = PROPARALLEL_UNSAFE;
+
+    if ( stmt->returnType != NULL ) {
+        char *typname = NameListToString(stmt->returnType->names);
+
+        decl->retset = stmt->returnType->setof;
+        decl->isTrigger = strcmp(typname, "trigger") == 0 || strcmp(typname, "event_trigger") == 0
+                         || strcmp(typname, "pg_catalog.trigger") == 0
+                         || strcmp(typname, "pg_catalog.event_trigger") == 0;
+    }
+
+    foreach(lc, stmt->options) {
+        DefElem *d = (DefElem *) lfirst(lc);
+
+        if ( strcmp(d->defname, "as") == 0 ) {
+            decl->body = strVal(linitial((List *) d->arg));
+        }
+        else if ( strcmp(d->defname, "language") == 0 ) {
+            decl->language = strVal(d->arg);
+        }
+        else if ( strcmp(d->defname, "volatility") == 0 ) {
+            char *v = strVal(d->arg);
+
+            decl->volatility = strcmp(v, "immutable") == 0 ? PROVOLATILE_IMMUTABLE
+                             : strcmp(v, "stable") == 0 ? PROVOLATILE_STABLE
+                             : PROVOLATILE_VOLATILE;
+        }
+        else if ( strcmp(d->defname, "parallel") == 0 ) {
+            char *p = strVal(d->arg);
+
+            decl->parallel = strcmp(p, "safe") == 0 ? PROPARALLEL_SAFE
+                           : strcmp(p, "restricted") == 0 ? PROPARALLEL_RESTRICTED
+                           : PROPARALLEL_UNSAFE;
+        }
+        else if ( strcmp(d->defname, "strict") == 0 ) {
+            decl->strict = intVal(d->arg);
+        }
+        else if ( strcmp(d->defname, "security") == 0 ) {
+            decl->secdef = intVal(d->arg);
+        }
+        else if ( strcmp(d->defname, "set") == 0 ) {
+            decl->hasSet = true;
+        }
+    }
+}
+
+/*
+ * 在子事务里分析函数体，函数体引用了还不存在的对象等情况
+ * 只报告无法分析，不影响审核其它部分．
+ */
+static bool analyzeBody(FuncDecl *decl, CreateFunctionStmt *stmt, FuncBodyInfo *info) {
+    MemoryContext oldcxt = CurrentMemoryContext;
+    ResourceOwner oldowner = CurrentResourceOwner;
+    bool          ok = true;
+
+    BeginInternalSubTransaction(NULL);
+    MemoryContextSwitchTo(oldcxt);
+
+    PG_TRY();
+    {
+        if ( pg_strcasecmp(decl->language, "sql") == 0 ) {
+            analyzeSqlBody(decl, stmt, info);
+        }
+        else {
+            info->advisory = true;
+            analyzePlpgsqlBody(decl, info);
+        }
+
+        ReleaseCurrentSubTransaction();
+        MemoryContextSwitchTo(oldcxt);
+        CurrentResourceOwner = oldowner;
+    }
+    PG_CATCH();
+    {
+        ErrorData *edata;
+
+        MemoryContextSwitchTo(oldcxt);
+        edata = CopyErrorData();
+        FlushErrorState();
+
+        RollbackAndReleaseCurrentSubTransaction();
+        MemoryContextSwitchTo(oldcxt);
+        CurrentResourceOwner = oldowner;
+
+        // 取消、关闭和内存不足不是函数体的问题，不能吞掉
+        if ( edata->sqlerrcode == ERRCODE_QUERY_CANCELED
+            ||
+             edata->sqlerrcode == ERRCODE_ADMIN_SHUTDOWN
+            ||
+             edata->sqlerrcode == ERRCODE_CRASH_SHUTDOWN
+            ||
+             edata->sqlerrcode == ERRCODE_OUT_OF_MEMORY ) {
+            ReThrowError(edata);
+        }
+
+        ereport(NOTICE,
+                (errcode(ERRCODE_SUCCESSFUL_COMPLETION),
+                    errmsg("QunarSQLAudit: cannot analyze the body of function %s: %s",
+                           decl->name, edata->message)));
+        FreeErrorData(edata);
+        ok = false;
+    }
+    PG_END_TRY();
+
+    return ok;
+}
+
+/* 声明的标记对性能的影响 */
+static void reportDeclared(FuncDecl *decl) {
+    const char *vmsg;
+    const char *pmsg;
+
+    switch ( decl->volatility ) {
+        case PROVOLATILE_IMMUTABLE:
+            vmsg = "can be folded to a constant at plan time and used in index expressions";
+            break;
+        case PROVOLATILE_STABLE:
+            vmsg = "is evaluated once per index scan when compared to an indexed column, "
+                   "but cannot be used in index expressions";
+            break;
+        default:
+            vmsg = "is re-evaluated for every row, is never folded to a constant, "
+                   "cannot be used as an index scan key or in index expressions";
+            break;
+    }
+
+    switch ( decl->parallel ) {
+        case PROPARALLEL_SAFE:
+            pmsg = "does not prevent parallel query";
+            break;
+        case PROPARALLEL_RESTRICTED:
+            pmsg = "forces the part of the plan calling it to run in the parallel leader";
+            break;
+        default:
+            pmsg = "disables parallel query for every statement calling it";
+            break;
+    }
+
+    ereport(NOTICE,
+            (errcode(ERRCODE_SUCCESSFUL_COMPLETION),
+                errmsg("QunarSQLAudit: function %s is %s: it %s; %s: it %s",
+                       decl->name,
+                       volatilityName(decl->volatility), vmsg,
+                       parallelName(decl->parallel), pmsg)));
+}
+
+/*
+ * checkCreateFunction - 审核 CREATE FUNCTION 的 volatility，PARALLEL 和内联
+ */
+void checkCreateFunction(CreateFunctionStmt *stmt) {
+    FuncDecl      decl;
+    FuncBodyInfo  info;
+    ListCell     *lc;
+    int           level = pgsword_enforce_function_volatility ? ERROR : WARNING;
+
+    parseDecl(stmt, &decl);
+
+    reportDeclared(&decl);
+
+    if ( decl.body == NULL || decl.language == NULL || decl.isTrigger ) {
+        return;
+    }
+
+    if ( pg_strcasecmp(decl.language, "sql") != 0
+        && pg_strcasecmp(decl.language, "plpgsql") != 0 ) {
+        ereport(NOTICE,
+                (errcode(ERRCODE_SUCCESSFUL_COMPLETION),
+                    errmsg("QunarSQLAudit: the body of %s function %s is not analyzed, "
+                           "make sure its volatility and parallel safety are declared correctly",
+                           decl.language, decl.name)));
+        return;
+    }
+
+    memset(&info, 0, sizeof(FuncBodyInfo));
+    info.volatility = PROVOLATILE_IMMUTABLE;
+    info.parallel = PROPARALLEL_SAFE;
+
+    if ( !analyzeBody(&decl, stmt, &info) ) {
+        return;
+    }
+
+    foreach(lc, info.noInline) {
+        ereport(NOTICE,
+                (errcode(ERRCODE_SUCCESSFUL_COMPLETION),
+                    errmsg("QunarSQLAudit: function %s cannot be inlined: %s",
+                           decl.name, (char *) lfirst(lc))));
+    }
+
+    // PL/pgSQL 只是词法扫描，可能误判，不拒绝
+    if ( info.advisory ) {
+        level = WARNING;
+    }
+
+    if ( info.opaque ) {
+        ereport(NOTICE,
+                (errcode(ERRCODE_SUCCESSFUL_COMPLETION),
+                    errmsg("QunarSQLAudit: function %s runs dynamic SQL, "
+                           "its volatility and parallel safety cannot be verified", decl.name)));
+        return;
+    }
+
+    // 声明得比函数体实际的严格，查询结果或者索引可能出错
+    if ( decl.volatility < info.volatility ) {
+        ereport(level,
+                (errcode(ERRCODE_INTERNAL_ERROR),
+                    errmsg("QunarSQLAudit: function %s is declared %s but it %s",
+                           decl.name, volatilityName(decl.volatility), info.volatileWhy),
+                    errdetail("a mislabeled function can return stale results from cached plans "
+                              "and corrupt index expressions that use it"),
+                    errhint("declare it %s", volatilityName(info.volatility))));
+    }
+    else if ( decl.volatility > info.volatility ) {
+        ereport(level,
+                (errcode(ERRCODE_INTERNAL_ERROR),
+                    errmsg("QunarSQLAudit: function %s is declared %s but can be %s",
+                           decl.name, volatilityName(decl.volatility),
+                           volatilityName(info.volatility)),
+                    errhint("declare it %s", volatilityName(info.volatility))));
+    }
+
+    if ( parallelRank(decl.parallel) < parallelRank(info.parallel) ) {
+        ereport(level,
+                (errcode(ERRCODE_INTERNAL_ERROR),
+                    errmsg("QunarSQLAudit: function %s is declared %s but it %s",
+                           decl.name, parallelName(decl.parallel), info.parallelWhy),
+                    errhint("declare it %s", parallelName(info.parallel))));
+    }
+    else if ( parallelRank(decl.parallel) > parallelRank(info.parallel) ) {
+        ereport(level,
+                (errcode(ERRCODE_INTERNAL_ERROR),
+                    errmsg("QunarSQLAudit: function %s is declared %s but can be %s",
+                           decl.name, parallelName(decl.parallel), parallelName(info.parallel)),
+                    errhint("declare it %s", parallelName(info.parallel))));
+    }
+}
@@ -0,0 +1,9 @@
+#ifndef _Qunar_SQL_Audit_VOLATILITY_H
+#define _Qunar_SQL_Audit_VOLATILITY_H
+
+#include "postgres.h"
+#include "nodes/parsenodes.h"
+
+void checkCreateFunction(CreateFunctionStmt *stmt);
+
+#endif